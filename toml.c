@@ -34,6 +34,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static void *(*ppmalloc)(size_t) = malloc;
 static void (*ppfree)(void *) = free;
@@ -63,17 +64,7 @@ static void *CALLOC(size_t nmemb, size_t sz) {
 
 // some old platforms define strdup macro -- drop it.
 #undef strdup
-#define strdup(x) error - forbidden - use STRDUP instead
-
-static char *STRDUP(const char *s) {
-  int len = strlen(s);
-  char *p = MALLOC(len + 1);
-  if (p) {
-    memcpy(p, s, len);
-    p[len] = 0;
-  }
-  return p;
-}
+#define strdup(x) error - forbidden - use STRNDUP instead
 
 // some old platforms define strndup macro -- drop it.
 #undef strndup
@@ -278,11 +269,6 @@ int toml_ucs_to_utf8(int64_t code, char buf[6]) {
  *	TOML has 3 data structures: value, array, table.
  *	Each of them can have identification key.
  */
-typedef struct toml_keyval_t toml_keyval_t;
-struct toml_keyval_t {
-  const char *key; /* key to this value */
-  const char *val; /* the raw value */
-};
 
 typedef struct toml_arritem_t toml_arritem_t;
 struct toml_arritem_t {
@@ -299,8 +285,31 @@ struct toml_array_t {
   int type;        /* for value kind: 'i'nt, 'd'ouble, 'b'ool, 's'tring, 't'ime,
                       'D'ate, 'T'imestamp, 'm'ixed */
 
-  int nitem; /* number of elements */
-  toml_arritem_t *item;
+  int nitem;            /* number of elements */
+  int capitem;          /* allocated size of item[] */
+  toml_arritem_t *item; /* 0 if the array is packed */
+
+  /* packed storage for value arrays of a single type. see pack_array(). */
+  char *pool; /* all raw values, each NUL terminated */
+  int *off;   /* offset of each raw value in pool */
+  void *data; /* decoded values: int64_t[] for type 'i', double[] for 'd' */
+
+  bool borrowed; /* values and packed storage belong to an image */
+};
+
+/* An entry in a table. Values are held inline; arrays and tables are
+ * owned by the entry and share their key with it.
+ */
+typedef struct toml_tabent_t toml_tabent_t;
+struct toml_tabent_t {
+  uint32_t hash;   /* key_hash(key) */
+  int kind;        /* 'v'alue, 'a'rray or 't'able */
+  const char *key; /* key to this entry */
+  union {
+    char *val; /* the raw value */
+    toml_array_t *arr;
+    toml_table_t *tab;
+  } u;
 };
 
 struct toml_table_t {
@@ -308,17 +317,80 @@ struct toml_table_t {
   bool implicit;   /* table was created implicitly */
   bool readonly;   /* no more modification allowed */
 
-  /* key-values in the table */
-  int nkval;
-  toml_keyval_t **kval;
+  /* entries in the table, in the order they were defined */
+  int nent, capent;
+  toml_tabent_t *ent;
+
+  /* #entries of each kind */
+  int nkval, narr, ntab;
+
+  /* open-addressing index of ent[] by hash, built once the table grows
+   * past INDEX_MIN entries. Each slot holds an index into ent[] plus 1,
+   * or 0 if empty. */
+  int capidx;
+  int *idx;
 
-  /* arrays in the table */
-  int narr;
-  toml_array_t **arr;
+  bool borrowed; /* values belong to an image */
 
-  /* tables in the table */
-  int ntab;
-  toml_table_t **tab;
+  /* root only: the pool that holds the keys of the document, and whether
+   * it is shared with other documents. */
+  toml_keypool_t *keys;
+  bool sharedkeys;
+};
+
+/* Interned keys. Each distinct key is stored once, in the pool of its
+ * document. Nodes point at the pooled copy and never free it, and two
+ * keys of a document are equal if and only if their pointers are.
+ */
+typedef struct toml_poolent_t toml_poolent_t;
+struct toml_poolent_t {
+  uint32_t hash; /* key_hash(key) */
+  char *key;     /* 0 if the slot is empty */
+};
+
+struct toml_keypool_t {
+  int nkey; /* #keys in the pool */
+  int cap;  /* #slots; a power of 2 */
+  toml_poolent_t *slot;
+};
+
+/* The key paths to keep, see toml_options_t, as a trie of pooled keys. A
+ * node without children keeps everything under it. PROJ_ALL stands for
+ * all the entries below a kept node.
+ */
+typedef struct toml_proj_t toml_proj_t;
+struct toml_proj_t {
+  const char *key;
+  int nchild, capchild;
+  toml_proj_t *child;
+};
+
+static const toml_proj_t proj_all;
+#define PROJ_ALL (&proj_all)
+
+/* What toml_validate() keeps of a document: the kind of each key, by the
+ * table that holds it, so that keys defined twice are caught without
+ * building the tree. Nodes are numbered from 0, the root, and found by
+ * (parent, pooled key) in an open-addressed index. Elements of arrays
+ * have no key and are not indexed.
+ */
+typedef struct keynode_t keynode_t;
+struct keynode_t {
+  int parent;      /* the table that holds it */
+  const char *key; /* pooled; 0 for an element of an array */
+  char kind;       /* 'v'alue, 'a'rray or 't'able */
+  char akind;      /* for arrays: kind of the elements, as toml_array_t */
+  bool implicit;   /* for tables: created by a [x.y.z] path */
+  bool readonly;   /* for tables: an inline table */
+  int last;        /* for arrays: the last table element, or -1 */
+};
+
+typedef struct keyset_t keyset_t;
+struct keyset_t {
+  int nnode, capnode;
+  keynode_t *node;
+  int cap;   /* #slots; a power of 2 */
+  int *slot; /* node number plus 1, or 0 if the slot is empty */
 };
 
 static inline void xfree(const void *x) {
@@ -355,14 +427,34 @@ struct context_t {
   char *stop;
   char *errbuf;
   int errbufsz;
+  int errcode; /* TOML_ERR_* */
+
+  /* limits and what counts against them */
+  const toml_options_t *opts;
+  int nnode;
+  size_t nbyte;
+  int depth;
+
+  /* for opts->timeout_ms and opts->cancel */
+  bool watch;
+  int ntoken;
+  int64_t deadline;
 
   token_t tok;
   toml_table_t *root;
   toml_table_t *curtab;
+  toml_keypool_t *keys;
+
+  bool validate; /* only check the document; build no tree */
+  keyset_t kset; /* for validate: the keys instead of the tree */
+  int curnode;   /* for validate: the node of the current table */
+
+  const toml_proj_t *proj;    /* what to keep of the root */
+  const toml_proj_t *curproj; /* what to keep of curtab; 0 for nothing */
 
   struct {
     int top;
-    char *key[10];
+    const char *key[10];
     token_t tok[10];
   } tpath;
 };
@@ -378,59 +470,121 @@ static int next_token(context_t *ctx, int dotisspecial);
 */
 static int e_outofmemory(context_t *ctx, const char *fline) {
   snprintf(ctx->errbuf, ctx->errbufsz, "ERROR: out of memory (%s)", fline);
+  ctx->errcode = TOML_ERR_NOMEM;
   return -1;
 }
 
 static int e_internal(context_t *ctx, const char *fline) {
   snprintf(ctx->errbuf, ctx->errbufsz, "internal error (%s)", fline);
+  ctx->errcode = TOML_ERR_INTERNAL;
   return -1;
 }
 
 static int e_syntax(context_t *ctx, int lineno, const char *msg) {
   snprintf(ctx->errbuf, ctx->errbufsz, "line %d: %s", lineno, msg);
+  ctx->errcode = TOML_ERR_SYNTAX;
   return -1;
 }
 
 static int e_badkey(context_t *ctx, int lineno) {
   snprintf(ctx->errbuf, ctx->errbufsz, "line %d: bad key", lineno);
+  ctx->errcode = TOML_ERR_SYNTAX;
   return -1;
 }
 
 static int e_keyexists(context_t *ctx, int lineno) {
   snprintf(ctx->errbuf, ctx->errbufsz, "line %d: key exists", lineno);
+  ctx->errcode = TOML_ERR_SYNTAX;
   return -1;
 }
 
 static int e_forbid(context_t *ctx, int lineno, const char *msg) {
   snprintf(ctx->errbuf, ctx->errbufsz, "line %d: %s", lineno, msg);
+  ctx->errcode = TOML_ERR_SYNTAX;
   return -1;
 }
 
-static void *expand(void *p, int sz, int newsz) {
-  void *s = MALLOC(newsz);
-  if (!s)
-    return 0;
+static int e_limit(context_t *ctx, int lineno, const char *msg) {
+  snprintf(ctx->errbuf, ctx->errbufsz, "line %d: %s", lineno, msg);
+  ctx->errcode = TOML_ERR_LIMIT;
+  return -1;
+}
 
-  memcpy(s, p, sz);
-  FREE(p);
-  return s;
+/* Count nnode new nodes, and nbyte bytes allocated for the tree, against
+ * the limits of the parse.
+ */
+static int charge(context_t *ctx, int nnode, size_t nbyte) {
+  const toml_options_t *opts = ctx->opts;
+  ctx->nnode += nnode;
+  ctx->nbyte += nbyte;
+  if (opts->max_nodes && ctx->nnode > opts->max_nodes)
+    return e_limit(ctx, ctx->tok.lineno, "too many nodes");
+  if (opts->max_memory && ctx->nbyte > opts->max_memory)
+    return e_limit(ctx, ctx->tok.lineno, "document takes too much memory");
+  return 0;
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called every so many tokens: give up if the parse has been cancelled or
+ * has run out of time.
+ */
+static int check_stop(context_t *ctx) {
+  const toml_options_t *opts = ctx->opts;
+  if (opts->cancel && opts->cancel(opts->cancel_arg)) {
+    snprintf(ctx->errbuf, ctx->errbufsz, "line %d: parse cancelled",
+             ctx->tok.lineno);
+    ctx->errcode = TOML_ERR_CANCELLED;
+    return -1;
+  }
+  if (opts->timeout_ms && now_ms() >= ctx->deadline) {
+    snprintf(ctx->errbuf, ctx->errbufsz, "line %d: parse timed out",
+             ctx->tok.lineno);
+    ctx->errcode = TOML_ERR_TIMEOUT;
+    return -1;
+  }
+  return 0;
+}
+
+/* Enter a nested table or array. The caller decrements ctx->depth on
+ * the way out.
+ */
+static int push_depth(context_t *ctx) {
+  ctx->depth++;
+  if (ctx->opts->max_depth && ctx->depth > ctx->opts->max_depth)
+    return e_limit(ctx, ctx->tok.lineno, "nesting is too deep");
+  return 0;
 }
 
-static void **expand_ptrarr(void **p, int n) {
-  void **s = MALLOC((n + 1) * sizeof(void *));
+static void *expand(void *p, int sz, int newsz) {
+  void *s = MALLOC(newsz);
   if (!s)
     return 0;
 
-  s[n] = 0;
-  memcpy(s, p, n * sizeof(void *));
-  FREE(p);
+  if (sz)
+    memcpy(s, p, sz);
+  xfree(p);
   return s;
 }
 
-static toml_arritem_t *expand_arritem(toml_arritem_t *p, int n) {
-  toml_arritem_t *pp = expand(p, n * sizeof(*p), (n + 1) * sizeof(*p));
-  if (!pp)
-    return 0;
+/* Return the next capacity for an array that is full at cap elements.
+ * Growing geometrically keeps appending n elements at O(n).
+ */
+static int grow_cap(int cap) { return cap < 4 ? 4 : cap + cap / 2; }
+
+static toml_arritem_t *expand_arritem(toml_arritem_t *p, int n, int *cap) {
+  toml_arritem_t *pp = p;
+  if (n >= *cap) {
+    int newcap = grow_cap(*cap);
+    pp = expand(p, n * sizeof(*p), newcap * sizeof(*p));
+    if (!pp)
+      return 0;
+    *cap = newcap;
+  }
 
   memset(&pp[n], 0, sizeof(pp[n]));
   return pp;
@@ -448,7 +602,7 @@ static char *norm_lit_str(const char *src, int srclen, int multiline,
   /* scan forward on src */
   for (;;) {
     if (off >= max - 10) { /* have some slack for misc stuff */
-      int newmax = max + 50;
+      int newmax = max ? max * 2 : 64;
       char *x = expand(dst, max, newmax);
       if (!x) {
         xfree(dst);
@@ -497,7 +651,7 @@ static char *norm_basic_str(const char *src, int srclen, int multiline,
   /* scan forward on src */
   for (;;) {
     if (off >= max - 10) { /* have some slack for misc stuff */
-      int newmax = max + 50;
+      int newmax = max ? max * 2 : 64;
       char *x = expand(dst, max, newmax);
       if (!x) {
         xfree(dst);
@@ -617,12 +771,99 @@ static char *norm_basic_str(const char *src, int srclen, int multiline,
   return dst;
 }
 
-/* Normalize a key. Convert all special chars to raw unescaped utf-8 chars. */
-static char *normalize_key(context_t *ctx, token_t strtok) {
+/* FNV-1a hash of a key */
+static uint32_t key_hash(const char *key) {
+  uint32_t h = 2166136261u;
+  for (; *key; key++)
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  return h;
+}
+
+/* Same as key_hash(), of the len bytes at key. */
+static uint32_t key_hash_len(const char *key, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)key[i]) * 16777619u;
+  return h;
+}
+
+toml_keypool_t *toml_keypool_new(void) {
+  return CALLOC(1, sizeof(toml_keypool_t));
+}
+
+void toml_keypool_free(toml_keypool_t *pool) {
+  if (!pool)
+    return;
+  for (int i = 0; i < pool->cap; i++)
+    xfree(pool->slot[i].key);
+  xfree(pool->slot);
+  xfree(pool);
+}
+
+/* Return the pooled copy of the len bytes at key, adding it if it is not
+ * in the pool yet. Return 0 if out of memory. */
+static const char *keypool_add(toml_keypool_t *pool, const char *key,
+                               size_t len) {
+  uint32_t hash = key_hash_len(key, len);
+
+  /* keep the pool at most half full */
+  if (2 * (pool->nkey + 1) > pool->cap) {
+    int cap = pool->cap ? pool->cap * 2 : 64;
+    toml_poolent_t *slot = CALLOC(cap, sizeof(*slot));
+    if (!slot)
+      return 0;
+    for (int i = 0; i < pool->cap; i++) {
+      toml_poolent_t *e = &pool->slot[i];
+      if (!e->key)
+        continue;
+      int j = e->hash & (cap - 1);
+      while (slot[j].key)
+        j = (j + 1) & (cap - 1);
+      slot[j] = *e;
+    }
+    xfree(pool->slot);
+    pool->slot = slot;
+    pool->cap = cap;
+  }
+
+  int mask = pool->cap - 1;
+  int j = hash & mask;
+  for (; pool->slot[j].key; j = (j + 1) & mask) {
+    toml_poolent_t *e = &pool->slot[j];
+    if (e->hash == hash && 0 == strncmp(e->key, key, len) && !e->key[len])
+      return e->key;
+  }
+
+  char *copy = STRNDUP(key, len);
+  if (!copy)
+    return 0;
+  pool->slot[j].hash = hash;
+  pool->slot[j].key = copy;
+  pool->nkey++;
+  return copy;
+}
+
+/* Add key[0..len-1] to the pool of the document. */
+static const char *intern_key(context_t *ctx, const char *key, size_t len) {
+  const int nkey = ctx->keys->nkey;
+  const char *ret = keypool_add(ctx->keys, key, len);
+  if (!ret) {
+    e_outofmemory(ctx, FLINE);
+    return 0;
+  }
+  if (ctx->keys->nkey > nkey && charge(ctx, 0, len + 1))
+    return 0;
+  return ret;
+}
+
+/* Normalize a key. Convert all special chars to raw unescaped utf-8 chars.
+ * Return the pooled copy of the key.
+ */
+static const char *normalize_key(context_t *ctx, token_t strtok) {
   const char *sp = strtok.ptr;
   const char *sq = strtok.ptr + strtok.len;
   int lineno = strtok.lineno;
-  char *ret;
+  const char *ret;
   int ch = *sp;
   char ebuf[80];
 
@@ -630,32 +871,35 @@ static char *normalize_key(context_t *ctx, token_t strtok) {
   if (ch == '\'' || ch == '\"') {
     /* if ''' or """, take 3 chars off front and back. Else, take 1 char off. */
     int multiline = 0;
-    if (sp[1] == ch && sp[2] == ch) {
+    if (strtok.len >= 6 && sp[1] == ch && sp[2] == ch) {
       sp += 3, sq -= 3;
       multiline = 1;
     } else
       sp++, sq--;
 
     if (ch == '\'') {
-      /* for single quote, take it verbatim. */
-      if (!(ret = STRNDUP(sp, sq - sp))) {
-        e_outofmemory(ctx, FLINE);
+      /* for single quote, take it verbatim. newlines are not allowed. */
+      if (memchr(sp, '\n', sq - sp)) {
+        e_badkey(ctx, lineno);
         return 0;
       }
+      ret = intern_key(ctx, sp, sq - sp);
     } else {
       /* for double quote, we need to normalize */
-      ret = norm_basic_str(sp, sq - sp, multiline, ebuf, sizeof(ebuf));
-      if (!ret) {
+      char *str = norm_basic_str(sp, sq - sp, multiline, ebuf, sizeof(ebuf));
+      if (!str) {
         e_syntax(ctx, lineno, ebuf);
         return 0;
       }
-    }
 
-    /* newlines are not allowed in keys */
-    if (strchr(ret, '\n')) {
-      xfree(ret);
-      e_badkey(ctx, lineno);
-      return 0;
+      /* newlines are not allowed in keys */
+      if (strchr(str, '\n')) {
+        xfree(str);
+        e_badkey(ctx, lineno);
+        return 0;
+      }
+      ret = intern_key(ctx, str, strlen(str));
+      xfree(str);
     }
     return ret;
   }
@@ -672,194 +916,241 @@ static char *normalize_key(context_t *ctx, token_t strtok) {
     return 0;
   }
 
-  /* dup and return it */
-  if (!(ret = STRNDUP(sp, sq - sp))) {
-    e_outofmemory(ctx, FLINE);
-    return 0;
-  }
-  return ret;
+  /* look it up in the pool, adding it if needed */
+  return intern_key(ctx, sp, sq - sp);
 }
 
-/*
- * Look up key in tab. Return 0 if not found, or
- * 'v'alue, 'a'rray or 't'able depending on the element.
- */
-static int check_key(toml_table_t *tab, const char *key,
-                     toml_keyval_t **ret_val, toml_array_t **ret_arr,
-                     toml_table_t **ret_tab) {
-  int i;
-  void *dummy;
+/* Tables smaller than this are searched by a linear scan of ent[]. */
+#define INDEX_MIN 16
 
-  if (!ret_tab)
-    ret_tab = (toml_table_t **)&dummy;
-  if (!ret_arr)
-    ret_arr = (toml_array_t **)&dummy;
-  if (!ret_val)
-    ret_val = (toml_keyval_t **)&dummy;
+/* Insert ent[i] into the index of tab. There must be a free slot. */
+static void index_entry(toml_table_t *tab, int i) {
+  int mask = tab->capidx - 1;
+  int j = tab->ent[i].hash & mask;
+  while (tab->idx[j])
+    j = (j + 1) & mask;
+  tab->idx[j] = i + 1;
+}
+
+/* Rebuild the index of tab with cap slots. cap must be a power of 2. */
+static int build_index(toml_table_t *tab, int cap) {
+  int *idx = CALLOC(cap, sizeof(*idx));
+  if (!idx)
+    return -1;
 
-  *ret_tab = 0;
-  *ret_arr = 0;
-  *ret_val = 0;
+  xfree(tab->idx);
+  tab->idx = idx;
+  tab->capidx = cap;
+  for (int i = 0; i < tab->nent; i++)
+    index_entry(tab, i);
+  return 0;
+}
 
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key)) {
-      *ret_val = tab->kval[i];
-      return 'v';
+/*
+ * Look up key in tab. Return 0 if not found, or the entry. A key from
+ * the pool of the document matches by pointer, without a strcmp().
+ */
+static toml_tabent_t *find_entry_hash(const toml_table_t *tab,
+                                     const char *key, uint32_t hash) {
+  if (tab->idx) {
+    int mask = tab->capidx - 1;
+    for (int j = hash & mask; tab->idx[j]; j = (j + 1) & mask) {
+      toml_tabent_t *e = &tab->ent[tab->idx[j] - 1];
+      if (e->hash == hash && (e->key == key || 0 == strcmp(key, e->key)))
+        return e;
     }
+    return 0;
   }
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key)) {
-      *ret_arr = tab->arr[i];
-      return 'a';
+
+  for (int i = 0; i < tab->nent; i++) {
+    toml_tabent_t *e = &tab->ent[i];
+    if (e->hash == hash && (e->key == key || 0 == strcmp(key, e->key)))
+      return e;
+  }
+  return 0;
+}
+
+static toml_tabent_t *find_entry(const toml_table_t *tab, const char *key) {
+  return find_entry_hash(tab, key, key_hash(key));
+}
+
+/*
+ * Append an entry of kind 'v', 'a' or 't' for key to tab. The caller
+ * fills in e->u. The returned pointer is valid until the next append.
+ */
+static toml_tabent_t *add_entry(context_t *ctx, toml_table_t *tab,
+                                const char *key, int kind) {
+  if (charge(ctx, 1, sizeof(toml_tabent_t)))
+    return 0;
+
+  const int n = tab->nent;
+  if (n == tab->capent) {
+    int newcap = grow_cap(n);
+    toml_tabent_t *ent =
+        expand(tab->ent, n * sizeof(*ent), newcap * sizeof(*ent));
+    if (!ent) {
+      e_outofmemory(ctx, FLINE);
+      return 0;
     }
+    tab->ent = ent;
+    tab->capent = newcap;
   }
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key)) {
-      *ret_tab = tab->tab[i];
-      return 't';
+
+  /* keep the index at most half full */
+  if (n + 1 >= INDEX_MIN && 2 * (n + 1) > tab->capidx) {
+    int cap = tab->capidx ? tab->capidx * 2 : 4 * INDEX_MIN;
+    if (build_index(tab, cap)) {
+      e_outofmemory(ctx, FLINE);
+      return 0;
     }
   }
-  return 0;
-}
 
-static int key_kind(toml_table_t *tab, const char *key) {
-  return check_key(tab, key, 0, 0, 0);
+  toml_tabent_t *e = &tab->ent[n];
+  memset(e, 0, sizeof(*e));
+  e->hash = key_hash(key);
+  e->kind = kind;
+  e->key = key;
+  tab->nent++;
+  if (tab->idx)
+    index_entry(tab, n);
+
+  switch (kind) {
+  case 'v':
+    tab->nkval++;
+    break;
+  case 'a':
+    tab->narr++;
+    break;
+  case 't':
+    tab->ntab++;
+    break;
+  }
+  return e;
 }
 
-/* Create a keyval in the table.
+/* Add a new table under a pooled key to tab.
  */
-static toml_keyval_t *create_keyval_in_table(context_t *ctx, toml_table_t *tab,
-                                             token_t keytok) {
-  /* first, normalize the key to be used for lookup.
-   * remember to free it if we error out.
-   */
-  char *newkey = normalize_key(ctx, keytok);
-  if (!newkey)
+static toml_table_t *add_table(context_t *ctx, toml_table_t *tab,
+                               const char *key) {
+  if (charge(ctx, 0, sizeof(toml_table_t)))
     return 0;
+  toml_table_t *dest = CALLOC(1, sizeof(*dest));
+  if (!dest) {
+    e_outofmemory(ctx, FLINE);
+    return 0;
+  }
 
-  /* if key exists: error out. */
-  toml_keyval_t *dest = 0;
-  if (key_kind(tab, newkey)) {
-    xfree(newkey);
-    e_keyexists(ctx, keytok.lineno);
+  toml_tabent_t *e = add_entry(ctx, tab, key, 't');
+  if (!e) {
+    xfree(dest);
     return 0;
   }
+  e->u.tab = dest;
 
-  /* make a new entry */
-  int n = tab->nkval;
-  toml_keyval_t **base;
-  if (0 == (base = (toml_keyval_t **)expand_ptrarr((void **)tab->kval, n))) {
-    xfree(newkey);
+  /* save the key in the new table struct */
+  dest->key = key;
+  return dest;
+}
+
+/* Add a new array under a pooled key to tab.
+ */
+static toml_array_t *add_array(context_t *ctx, toml_table_t *tab,
+                               const char *key) {
+  if (charge(ctx, 0, sizeof(toml_array_t)))
+    return 0;
+  toml_array_t *dest = CALLOC(1, sizeof(*dest));
+  if (!dest) {
     e_outofmemory(ctx, FLINE);
     return 0;
   }
-  tab->kval = base;
 
-  if (0 == (base[n] = (toml_keyval_t *)CALLOC(1, sizeof(*base[n])))) {
-    xfree(newkey);
-    e_outofmemory(ctx, FLINE);
+  toml_tabent_t *e = add_entry(ctx, tab, key, 'a');
+  if (!e) {
+    xfree(dest);
     return 0;
   }
-  dest = tab->kval[tab->nkval++];
+  e->u.arr = dest;
 
-  /* save the key in the new value struct */
-  dest->key = newkey;
+  /* save the key in the new array struct */
+  dest->key = key;
   return dest;
 }
 
+/* Create a keyval in the table.
+ */
+static toml_tabent_t *create_keyval_in_table(context_t *ctx, toml_table_t *tab,
+                                             token_t keytok) {
+  /* first, normalize the key to be used for lookup. */
+  const char *newkey = normalize_key(ctx, keytok);
+  if (!newkey)
+    return 0;
+
+  /* if key exists: error out. */
+  if (find_entry(tab, newkey)) {
+    e_keyexists(ctx, keytok.lineno);
+    return 0;
+  }
+
+  /* make a new entry */
+  return add_entry(ctx, tab, newkey, 'v');
+}
+
 /* Create a table in the table.
  */
 static toml_table_t *create_keytable_in_table(context_t *ctx, toml_table_t *tab,
                                               token_t keytok) {
-  /* first, normalize the key to be used for lookup.
-   * remember to free it if we error out.
-   */
-  char *newkey = normalize_key(ctx, keytok);
+  /* first, normalize the key to be used for lookup. */
+  const char *newkey = normalize_key(ctx, keytok);
   if (!newkey)
     return 0;
 
   /* if key exists: error out */
-  toml_table_t *dest = 0;
-  if (check_key(tab, newkey, 0, 0, &dest)) {
-    xfree(newkey); /* don't need this anymore */
-
+  toml_tabent_t *e = find_entry(tab, newkey);
+  if (e) {
     /* special case: if table exists, but was created implicitly ... */
-    if (dest && dest->implicit) {
+    if (e->kind == 't' && e->u.tab->implicit) {
       /* we make it explicit now, and simply return it. */
-      dest->implicit = false;
-      return dest;
+      e->u.tab->implicit = false;
+      return e->u.tab;
     }
     e_keyexists(ctx, keytok.lineno);
     return 0;
   }
 
   /* create a new table entry */
-  int n = tab->ntab;
-  toml_table_t **base;
-  if (0 == (base = (toml_table_t **)expand_ptrarr((void **)tab->tab, n))) {
-    xfree(newkey);
-    e_outofmemory(ctx, FLINE);
-    return 0;
-  }
-  tab->tab = base;
-
-  if (0 == (base[n] = (toml_table_t *)CALLOC(1, sizeof(*base[n])))) {
-    xfree(newkey);
-    e_outofmemory(ctx, FLINE);
-    return 0;
-  }
-  dest = tab->tab[tab->ntab++];
-
-  /* save the key in the new table struct */
-  dest->key = newkey;
-  return dest;
+  return add_table(ctx, tab, newkey);
 }
 
 /* Create an array in the table.
  */
 static toml_array_t *create_keyarray_in_table(context_t *ctx, toml_table_t *tab,
                                               token_t keytok, char kind) {
-  /* first, normalize the key to be used for lookup.
-   * remember to free it if we error out.
-   */
-  char *newkey = normalize_key(ctx, keytok);
+  /* first, normalize the key to be used for lookup. */
+  const char *newkey = normalize_key(ctx, keytok);
   if (!newkey)
     return 0;
 
   /* if key exists: error out */
-  if (key_kind(tab, newkey)) {
-    xfree(newkey); /* don't need this anymore */
+  if (find_entry(tab, newkey)) {
     e_keyexists(ctx, keytok.lineno);
     return 0;
   }
 
   /* make a new array entry */
-  int n = tab->narr;
-  toml_array_t **base;
-  if (0 == (base = (toml_array_t **)expand_ptrarr((void **)tab->arr, n))) {
-    xfree(newkey);
-    e_outofmemory(ctx, FLINE);
-    return 0;
-  }
-  tab->arr = base;
-
-  if (0 == (base[n] = (toml_array_t *)CALLOC(1, sizeof(*base[n])))) {
-    xfree(newkey);
-    e_outofmemory(ctx, FLINE);
+  toml_array_t *dest = add_array(ctx, tab, newkey);
+  if (!dest)
     return 0;
-  }
-  toml_array_t *dest = tab->arr[tab->narr++];
 
-  /* save the key in the new array struct */
-  dest->key = newkey;
   dest->kind = kind;
   return dest;
 }
 
 static toml_arritem_t *create_value_in_array(context_t *ctx,
                                              toml_array_t *parent) {
+  if (charge(ctx, 1, sizeof(toml_arritem_t)))
+    return 0;
   const int n = parent->nitem;
-  toml_arritem_t *base = expand_arritem(parent->item, n);
+  toml_arritem_t *base = expand_arritem(parent->item, n, &parent->capitem);
   if (!base) {
     e_outofmemory(ctx, FLINE);
     return 0;
@@ -873,8 +1164,10 @@ static toml_arritem_t *create_value_in_array(context_t *ctx,
  */
 static toml_array_t *create_array_in_array(context_t *ctx,
                                            toml_array_t *parent) {
+  if (charge(ctx, 1, sizeof(toml_arritem_t) + sizeof(toml_array_t)))
+    return 0;
   const int n = parent->nitem;
-  toml_arritem_t *base = expand_arritem(parent->item, n);
+  toml_arritem_t *base = expand_arritem(parent->item, n, &parent->capitem);
   if (!base) {
     e_outofmemory(ctx, FLINE);
     return 0;
@@ -894,8 +1187,10 @@ static toml_array_t *create_array_in_array(context_t *ctx,
  */
 static toml_table_t *create_table_in_array(context_t *ctx,
                                            toml_array_t *parent) {
+  if (charge(ctx, 1, sizeof(toml_arritem_t) + sizeof(toml_table_t)))
+    return 0;
   int n = parent->nitem;
-  toml_arritem_t *base = expand_arritem(parent->item, n);
+  toml_arritem_t *base = expand_arritem(parent->item, n, &parent->capitem);
   if (!base) {
     e_outofmemory(ctx, FLINE);
     return 0;
@@ -921,7 +1216,69 @@ static int skip_newlines(context_t *ctx, int isdotspecial) {
   return 0;
 }
 
-static int parse_keyval(context_t *ctx, toml_table_t *tab);
+/* Return what to keep under key of a node kept as p, or 0 if nothing. */
+static const toml_proj_t *proj_child(const toml_proj_t *p, const char *key) {
+  if (p == PROJ_ALL)
+    return PROJ_ALL;
+  for (int i = 0; i < p->nchild; i++) {
+    const toml_proj_t *c = &p->child[i];
+    if (c->key == key)
+      return c->nchild ? c : PROJ_ALL;
+  }
+  return 0;
+}
+
+static void proj_free(toml_proj_t *p) {
+  for (int i = 0; i < p->nchild; i++)
+    proj_free(&p->child[i]);
+  xfree(p->child);
+  p->child = 0;
+  p->nchild = p->capchild = 0;
+}
+
+/* Add a dotted path such as "database.pool" to the trie at p. */
+static int proj_add(context_t *ctx, toml_proj_t *p, const char *path) {
+  for (;;) {
+    const char *dot = strchr(path, '.');
+    size_t len = dot ? (size_t)(dot - path) : strlen(path);
+    const char *key = keypool_add(ctx->keys, path, len);
+    if (!key)
+      return e_outofmemory(ctx, FLINE);
+
+    toml_proj_t *c = 0;
+    for (int i = 0; i < p->nchild && !c; i++)
+      if (p->child[i].key == key)
+        c = &p->child[i];
+
+    if (!c) {
+      if (p->nchild == p->capchild) {
+        int newcap = grow_cap(p->capchild);
+        toml_proj_t *child = expand(p->child, p->capchild * sizeof(*child),
+                                    newcap * sizeof(*child));
+        if (!child)
+          return e_outofmemory(ctx, FLINE);
+        p->child = child;
+        p->capchild = newcap;
+      }
+      c = &p->child[p->nchild++];
+      memset(c, 0, sizeof(*c));
+      c->key = key;
+      if (!dot)
+        return 0;
+    } else if (!c->nchild) {
+      return 0; /* a prefix of path is already kept */
+    } else if (!dot) {
+      proj_free(c); /* keep all of c */
+      return 0;
+    }
+
+    p = c;
+    path = dot + 1;
+  }
+}
+
+static int parse_keyval(context_t *ctx, toml_table_t *tab,
+                        const toml_proj_t *proj);
 
 static inline int eat_token(context_t *ctx, tokentype_t typ, int isdotspecial,
                             const char *fline) {
@@ -935,9 +1292,12 @@ static inline int eat_token(context_t *ctx, tokentype_t typ, int isdotspecial,
 }
 
 /* We are at '{ ... }'.
- * Parse the table.
+ * Parse the table, keeping what proj says. If proj is 0, tab is not used.
  */
-static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
+static int parse_inline_table(context_t *ctx, toml_table_t *tab,
+                              const toml_proj_t *proj) {
+  if (push_depth(ctx))
+    return -1;
   if (eat_token(ctx, LBRACE, 1, FLINE))
     return -1;
 
@@ -953,7 +1313,7 @@ static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
     if (ctx->tok.tok != STRING)
       return e_syntax(ctx, ctx->tok.lineno, "expect a string");
 
-    if (parse_keyval(ctx, tab))
+    if (parse_keyval(ctx, tab, proj))
       return -1;
 
     if (ctx->tok.tok == NEWLINE)
@@ -972,8 +1332,10 @@ static int parse_inline_table(context_t *ctx, toml_table_t *tab) {
   if (eat_token(ctx, RBRACE, 1, FLINE))
     return -1;
 
-  tab->readonly = 1;
+  if (tab)
+    tab->readonly = 1;
 
+  ctx->depth--;
   return 0;
 }
 
@@ -997,8 +1359,96 @@ static int valtype(const char *val) {
   return 'u'; /* unknown */
 }
 
-/* We are at '[...]' */
-static int parse_array(context_t *ctx, toml_array_t *arr) {
+/* Check the value at token val as valtype() would, without keeping it. */
+static int check_value(context_t *ctx, token_t val) {
+  if (*val.ptr == '\'' || *val.ptr == '"')
+    return 0; /* scan_string() has checked the quotes */
+
+  char buf[128];
+  char *s = buf;
+  if (val.len < (int)sizeof(buf)) {
+    memcpy(buf, val.ptr, val.len);
+    buf[val.len] = 0;
+  } else if (!(s = STRNDUP(val.ptr, val.len))) {
+    return e_outofmemory(ctx, FLINE);
+  }
+
+  int typ = valtype(s);
+  if (s != buf)
+    xfree(s);
+  if (typ == 'u')
+    return e_syntax(ctx, val.lineno, "bad value");
+  return 0;
+}
+
+/* Move the raw values of an array of values of a single type into one
+ * pool, and decode ints and doubles into a contiguous buffer. The
+ * per-element items are released afterwards, so this saves memory once
+ * the array is parsed, but not while it is: the items are allocated one
+ * by one first. The raw text is kept next to the decoded values for
+ * toml_raw_at(), which makes an array of ints about 3 times smaller than
+ * unpacked, not more.
+ */
+static int pack_array(context_t *ctx, toml_array_t *arr) {
+  const int n = arr->nitem;
+  if (arr->kind != 'v' || arr->type == 'm' || n == 0)
+    return 0;
+
+  size_t total = 0;
+  for (int i = 0; i < n; i++)
+    total += strlen(arr->item[i].val) + 1;
+  if (total > INT32_MAX)
+    return 0; /* offsets will not fit. leave it unpacked. */
+  if (charge(ctx, 0, n * (sizeof(int) + sizeof(int64_t))))
+    return -1;
+
+  char *pool = MALLOC(total);
+  int *off = MALLOC(n * sizeof(*off));
+  void *data = 0;
+  if (arr->type == 'i')
+    data = MALLOC(n * sizeof(int64_t));
+  else if (arr->type == 'd')
+    data = MALLOC(n * sizeof(double));
+
+  if (!pool || !off || (!data && (arr->type == 'i' || arr->type == 'd'))) {
+    xfree(pool);
+    xfree(off);
+    xfree(data);
+    return e_outofmemory(ctx, FLINE);
+  }
+
+  int pos = 0;
+  for (int i = 0; i < n; i++) {
+    char *val = arr->item[i].val;
+    int len = strlen(val);
+    memcpy(pool + pos, val, len + 1);
+    off[i] = pos;
+    pos += len + 1;
+
+    /* valtype() has already checked that these conversions succeed */
+    if (arr->type == 'i')
+      toml_rtoi(val, &((int64_t *)data)[i]);
+    else if (arr->type == 'd')
+      toml_rtod(val, &((double *)data)[i]);
+
+    xfree(val);
+  }
+  xfree(arr->item);
+
+  arr->item = 0;
+  arr->pool = pool;
+  arr->off = off;
+  arr->data = data;
+  return 0;
+}
+
+/* We are at '[...]'. Parse the array, keeping what proj says of each
+ * element. If proj is 0, arr is not used.
+ */
+static int parse_array(context_t *ctx, toml_array_t *arr,
+                       const toml_proj_t *proj) {
+  if (push_depth(ctx))
+    return -1;
   if (eat_token(ctx, LBRACKET, 0, FLINE))
     return -1;
 
@@ -1012,6 +1462,13 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
 
     switch (ctx->tok.tok) {
     case STRING: {
+      if (proj != PROJ_ALL) {
+        /* values are only kept as a whole */
+        if (eat_token(ctx, STRING, 0, FLINE))
+          return -1;
+        break;
+      }
+
       /* set array kind if this will be the first entry */
       if (arr->kind == 0)
         arr->kind = 'v';
@@ -1024,8 +1481,10 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
       /* make a new value in array */
       toml_arritem_t *newval = create_value_in_array(ctx, arr);
       if (!newval)
-        return e_outofmemory(ctx, FLINE);
+        return -1;
 
+      if (charge(ctx, 0, vlen + 1))
+        return -1;
       if (!(newval->val = STRNDUP(val, vlen)))
         return e_outofmemory(ctx, FLINE);
 
@@ -1043,31 +1502,37 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
     }
 
     case LBRACKET: { /* [ [array], [array] ... ] */
-      /* set the array kind if this will be the first entry */
-      if (arr->kind == 0)
-        arr->kind = 'a';
-      else if (arr->kind != 'a')
-        arr->kind = 'm';
-
-      toml_array_t *subarr = create_array_in_array(ctx, arr);
-      if (!subarr)
-        return -1;
-      if (parse_array(ctx, subarr))
+      toml_array_t *subarr = 0;
+      if (proj) {
+        /* set the array kind if this will be the first entry */
+        if (arr->kind == 0)
+          arr->kind = 'a';
+        else if (arr->kind != 'a')
+          arr->kind = 'm';
+
+        subarr = create_array_in_array(ctx, arr);
+        if (!subarr)
+          return -1;
+      }
+      if (parse_array(ctx, subarr, proj))
         return -1;
       break;
     }
 
     case LBRACE: { /* [ {table}, {table} ... ] */
-      /* set the array kind if this will be the first entry */
-      if (arr->kind == 0)
-        arr->kind = 't';
-      else if (arr->kind != 't')
-        arr->kind = 'm';
-
-      toml_table_t *subtab = create_table_in_array(ctx, arr);
-      if (!subtab)
-        return -1;
-      if (parse_inline_table(ctx, subtab))
+      toml_table_t *subtab = 0;
+      if (proj) {
+        /* set the array kind if this will be the first entry */
+        if (arr->kind == 0)
+          arr->kind = 't';
+        else if (arr->kind != 't')
+          arr->kind = 'm';
+
+        subtab = create_table_in_array(ctx, arr);
+        if (!subtab)
+          return -1;
+      }
+      if (parse_inline_table(ctx, subtab, proj))
         return -1;
       break;
     }
@@ -1088,18 +1553,97 @@ static int parse_array(context_t *ctx, toml_array_t *arr) {
     break;
   }
 
+  if (arr && pack_array(ctx, arr))
+    return -1;
+
   if (eat_token(ctx, RBRACKET, 1, FLINE))
     return -1;
+
+  ctx->depth--;
   return 0;
 }
 
-/* handle lines like these:
-   key = "value"
-   key = [ array ]
-   key = { table }
-*/
-static int parse_keyval(context_t *ctx, toml_table_t *tab) {
-  if (tab->readonly) {
+/* parse_keyval() for a table of which only some entries are kept. If
+ * proj is 0, the keyval is checked and dropped, and tab is not used.
+ */
+static int parse_keyval_proj(context_t *ctx, toml_table_t *tab,
+                             const toml_proj_t *proj) {
+  if (proj && tab->readonly) {
+    return e_forbid(ctx, ctx->tok.lineno,
+                    "cannot insert new entry into existing table");
+  }
+
+  token_t key = ctx->tok;
+  if (key.tok != STRING)
+    return e_internal(ctx, FLINE);
+  const char *keystr = normalize_key(ctx, key);
+  if (!keystr)
+    return -1;
+
+  const toml_proj_t *sub = proj ? proj_child(proj, keystr) : 0;
+  if (sub == PROJ_ALL)
+    return parse_keyval(ctx, tab, PROJ_ALL);
+
+  if (next_token(ctx, 1))
+    return -1;
+
+  if (ctx->tok.tok == DOT) {
+    toml_table_t *subtab = 0;
+    if (sub) {
+      subtab = toml_table_in(tab, keystr);
+      if (!subtab && !(subtab = create_keytable_in_table(ctx, tab, key)))
+        return -1;
+    }
+    if (next_token(ctx, 1))
+      return -1;
+    if (push_depth(ctx) || parse_keyval(ctx, subtab, sub))
+      return -1;
+    ctx->depth--;
+    return 0;
+  }
+
+  if (ctx->tok.tok != EQUAL) {
+    return e_syntax(ctx, ctx->tok.lineno, "missing =");
+  }
+
+  if (next_token(ctx, 0))
+    return -1;
+
+  switch (ctx->tok.tok) {
+  case STRING: /* values are only kept as a whole */
+    return next_token(ctx, 1);
+
+  case LBRACKET: {
+    toml_array_t *arr = 0;
+    if (sub && !(arr = create_keyarray_in_table(ctx, tab, key, 0)))
+      return -1;
+    return parse_array(ctx, arr, sub);
+  }
+
+  case LBRACE: {
+    toml_table_t *nxttab = 0;
+    if (sub && !(nxttab = create_keytable_in_table(ctx, tab, key)))
+      return -1;
+    return parse_inline_table(ctx, nxttab, sub);
+  }
+
+  default:
+    return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+  }
+}
+
+/* handle lines like these:
+   key = "value"
+   key = [ array ]
+   key = { table }
+   keeping what proj says of tab.
+*/
+static int parse_keyval(context_t *ctx, toml_table_t *tab,
+                        const toml_proj_t *proj) {
+  if (proj != PROJ_ALL)
+    return parse_keyval_proj(ctx, tab, proj);
+
+  if (tab->readonly) {
     return e_forbid(ctx, ctx->tok.lineno,
                     "cannot insert new entry into existing table");
   }
@@ -1116,12 +1660,11 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
     */
     toml_table_t *subtab = 0;
     {
-      char *subtabstr = normalize_key(ctx, key);
+      const char *subtabstr = normalize_key(ctx, key);
       if (!subtabstr)
         return -1;
 
       subtab = toml_table_in(tab, subtabstr);
-      xfree(subtabstr);
     }
     if (!subtab) {
       subtab = create_keytable_in_table(ctx, tab, key);
@@ -1130,8 +1673,9 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
     }
     if (next_token(ctx, 1))
       return -1;
-    if (parse_keyval(ctx, subtab))
+    if (push_depth(ctx) || parse_keyval(ctx, subtab, PROJ_ALL))
       return -1;
+    ctx->depth--;
     return 0;
   }
 
@@ -1144,13 +1688,15 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
 
   switch (ctx->tok.tok) {
   case STRING: { /* key = "value" */
-    toml_keyval_t *keyval = create_keyval_in_table(ctx, tab, key);
+    toml_tabent_t *keyval = create_keyval_in_table(ctx, tab, key);
     if (!keyval)
       return -1;
     token_t val = ctx->tok;
 
-    assert(keyval->val == 0);
-    if (!(keyval->val = STRNDUP(val.ptr, val.len)))
+    assert(keyval->u.val == 0);
+    if (charge(ctx, 0, val.len + 1))
+      return -1;
+    if (!(keyval->u.val = STRNDUP(val.ptr, val.len)))
       return e_outofmemory(ctx, FLINE);
 
     if (next_token(ctx, 1))
@@ -1163,7 +1709,7 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
     toml_array_t *arr = create_keyarray_in_table(ctx, tab, key, 0);
     if (!arr)
       return -1;
-    if (parse_array(ctx, arr))
+    if (parse_array(ctx, arr, PROJ_ALL))
       return -1;
     return 0;
   }
@@ -1172,14 +1718,358 @@ static int parse_keyval(context_t *ctx, toml_table_t *tab) {
     toml_table_t *nxttab = create_keytable_in_table(ctx, tab, key);
     if (!nxttab)
       return -1;
-    if (parse_inline_table(ctx, nxttab))
+    if (parse_inline_table(ctx, nxttab, PROJ_ALL))
+      return -1;
+    return 0;
+  }
+
+  default:
+    return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+  }
+  return 0;
+}
+
+static uint32_t keyset_hash(int parent, const char *key) {
+  uint64_t h = (uint64_t)(uintptr_t)key ^ ((uint64_t)parent << 32);
+  h *= UINT64_C(0x9e3779b97f4a7c15);
+  return (uint32_t)(h >> 32);
+}
+
+/* Return the node of key in table parent, or -1 if there is none. */
+static int keyset_find(const keyset_t *ks, int parent, const char *key) {
+  if (!ks->cap)
+    return -1;
+  const int mask = ks->cap - 1;
+  for (int j = keyset_hash(parent, key) & mask; ks->slot[j];
+       j = (j + 1) & mask) {
+    const keynode_t *p = &ks->node[ks->slot[j] - 1];
+    if (p->key == key && p->parent == parent)
+      return ks->slot[j] - 1;
+  }
+  return -1;
+}
+
+static void keyset_index(keyset_t *ks, int n) {
+  const int mask = ks->cap - 1;
+  int j = keyset_hash(ks->node[n].parent, ks->node[n].key) & mask;
+  while (ks->slot[j])
+    j = (j + 1) & mask;
+  ks->slot[j] = n + 1;
+}
+
+/* Add a node of kind under key, which may be 0, in table parent. Return
+ * its number, or -1 if out of memory. */
+static int keyset_add(context_t *ctx, int parent, const char *key,
+                      char kind) {
+  keyset_t *ks = &ctx->kset;
+  const int n = ks->nnode;
+  if (n == ks->capnode) {
+    int newcap = grow_cap(n);
+    keynode_t *node =
+        expand(ks->node, n * sizeof(*node), newcap * sizeof(*node));
+    if (!node)
+      return e_outofmemory(ctx, FLINE);
+    ks->node = node;
+    ks->capnode = newcap;
+  }
+
+  /* keep the index at most half full */
+  if (key && 2 * (n + 1) > ks->cap) {
+    int cap = ks->cap ? ks->cap * 2 : 64;
+    int *slot = CALLOC(cap, sizeof(*slot));
+    if (!slot)
+      return e_outofmemory(ctx, FLINE);
+    xfree(ks->slot);
+    ks->slot = slot;
+    ks->cap = cap;
+    for (int i = 0; i < n; i++) {
+      if (ks->node[i].key)
+        keyset_index(ks, i);
+    }
+  }
+
+  keynode_t *p = &ks->node[n];
+  memset(p, 0, sizeof(*p));
+  p->parent = parent;
+  p->key = key;
+  p->kind = kind;
+  p->last = -1;
+  ks->nnode++;
+  if (key)
+    keyset_index(ks, n);
+  return n;
+}
+
+static void keyset_free(keyset_t *ks) {
+  xfree(ks->node);
+  xfree(ks->slot);
+  memset(ks, 0, sizeof(*ks));
+}
+
+/* As create_key*_in_table(), add the key at keytok to table tab as a node
+ * of kind. Return its number, or -1 if the key exists. */
+static int check_key(context_t *ctx, int tab, token_t keytok, char kind) {
+  const char *key = normalize_key(ctx, keytok);
+  if (!key)
+    return -1;
+
+  int n = keyset_find(&ctx->kset, tab, key);
+  if (n >= 0) {
+    /* special case: a table created implicitly can be defined once */
+    keynode_t *p = &ctx->kset.node[n];
+    if (kind == 't' && p->kind == 't' && p->implicit) {
+      p->implicit = false;
+      return n;
+    }
+    return e_keyexists(ctx, keytok.lineno);
+  }
+  return keyset_add(ctx, tab, key, kind);
+}
+
+static int check_keyval(context_t *ctx, int tab);
+
+/* parse_inline_table() for toml_validate(). */
+static int check_inline_table(context_t *ctx, int tab) {
+  if (push_depth(ctx))
+    return -1;
+  if (eat_token(ctx, LBRACE, 1, FLINE))
+    return -1;
+
+  for (;;) {
+    if (ctx->tok.tok == NEWLINE)
+      return e_syntax(ctx, ctx->tok.lineno,
+                      "newline not allowed in inline table");
+
+    /* until } */
+    if (ctx->tok.tok == RBRACE)
+      break;
+
+    if (ctx->tok.tok != STRING)
+      return e_syntax(ctx, ctx->tok.lineno, "expect a string");
+
+    if (check_keyval(ctx, tab))
+      return -1;
+
+    if (ctx->tok.tok == NEWLINE)
+      return e_syntax(ctx, ctx->tok.lineno,
+                      "newline not allowed in inline table");
+
+    /* on comma, continue to scan for next keyval */
+    if (ctx->tok.tok == COMMA) {
+      if (eat_token(ctx, COMMA, 1, FLINE))
+        return -1;
+      continue;
+    }
+    break;
+  }
+
+  if (eat_token(ctx, RBRACE, 1, FLINE))
+    return -1;
+
+  ctx->kset.node[tab].readonly = true;
+  ctx->depth--;
+  return 0;
+}
+
+/* Set the kind of the elements of array arr as an element of kind is
+ * added. arr is -1 for an array in an array, which is never looked up. */
+static void check_element(context_t *ctx, int arr, char kind) {
+  if (arr < 0)
+    return;
+  keynode_t *p = &ctx->kset.node[arr];
+  if (p->akind == 0)
+    p->akind = kind;
+  else if (p->akind != kind)
+    p->akind = 'm';
+}
+
+/* parse_array() for toml_validate(). */
+static int check_array(context_t *ctx, int arr) {
+  if (push_depth(ctx))
+    return -1;
+  if (eat_token(ctx, LBRACKET, 0, FLINE))
+    return -1;
+
+  for (;;) {
+    if (skip_newlines(ctx, 0))
+      return -1;
+
+    /* until ] */
+    if (ctx->tok.tok == RBRACKET)
+      break;
+
+    switch (ctx->tok.tok) {
+    case STRING:
+      check_element(ctx, arr, 'v');
+      if (check_value(ctx, ctx->tok))
+        return -1;
+      if (eat_token(ctx, STRING, 0, FLINE))
+        return -1;
+      break;
+
+    case LBRACKET: /* [ [array], [array] ... ] */
+      check_element(ctx, arr, 'a');
+      if (check_array(ctx, -1))
+        return -1;
+      break;
+
+    case LBRACE: { /* [ {table}, {table} ... ] */
+      check_element(ctx, arr, 't');
+      int subtab = keyset_add(ctx, arr, 0, 't');
+      if (subtab < 0)
+        return -1;
+      if (arr >= 0)
+        ctx->kset.node[arr].last = subtab;
+      if (check_inline_table(ctx, subtab))
+        return -1;
+      break;
+    }
+
+    default:
+      return e_syntax(ctx, ctx->tok.lineno, "syntax error");
+    }
+
+    if (skip_newlines(ctx, 0))
+      return -1;
+
+    /* on comma, continue to scan for next element */
+    if (ctx->tok.tok == COMMA) {
+      if (eat_token(ctx, COMMA, 0, FLINE))
+        return -1;
+      continue;
+    }
+    break;
+  }
+
+  if (eat_token(ctx, RBRACKET, 1, FLINE))
+    return -1;
+
+  ctx->depth--;
+  return 0;
+}
+
+/* parse_keyval() for toml_validate(): record the key in table tab, and
+ * check the value without keeping it.
+ */
+static int check_keyval(context_t *ctx, int tab) {
+  if (ctx->kset.node[tab].readonly) {
+    return e_forbid(ctx, ctx->tok.lineno,
+                    "cannot insert new entry into existing table");
+  }
+
+  token_t key = ctx->tok;
+  if (eat_token(ctx, STRING, 1, FLINE))
+    return -1;
+
+  if (ctx->tok.tok == DOT) {
+    /* inline dotted key: enter the table, creating it if needed */
+    const char *subtabstr = normalize_key(ctx, key);
+    if (!subtabstr)
+      return -1;
+    int subtab = keyset_find(&ctx->kset, tab, subtabstr);
+    if (subtab < 0 || ctx->kset.node[subtab].kind != 't') {
+      if ((subtab = check_key(ctx, tab, key, 't')) < 0)
+        return -1;
+    }
+    if (next_token(ctx, 1))
       return -1;
+    if (push_depth(ctx) || check_keyval(ctx, subtab))
+      return -1;
+    ctx->depth--;
     return 0;
   }
 
+  if (ctx->tok.tok != EQUAL) {
+    return e_syntax(ctx, ctx->tok.lineno, "missing =");
+  }
+
+  if (next_token(ctx, 0))
+    return -1;
+
+  switch (ctx->tok.tok) {
+  case STRING: /* key = "value" */
+    if (check_key(ctx, tab, key, 'v') < 0 || check_value(ctx, ctx->tok))
+      return -1;
+    return next_token(ctx, 1);
+
+  case LBRACKET: { /* key = [ array ] */
+    int arr = check_key(ctx, tab, key, 'a');
+    if (arr < 0)
+      return -1;
+    return check_array(ctx, arr);
+  }
+
+  case LBRACE: { /* key = { table } */
+    int nxttab = check_key(ctx, tab, key, 't');
+    if (nxttab < 0)
+      return -1;
+    return check_inline_table(ctx, nxttab);
+  }
+
   default:
     return e_syntax(ctx, ctx->tok.lineno, "syntax error");
   }
+}
+
+/* walk_tabpath() and the rest of parse_select() for toml_validate(): find
+ * the table of [x.y.z] or [[x.y.z]], z being removed from tpath, and set
+ * ctx->curnode to it.
+ */
+static int check_select(context_t *ctx, token_t z, int llb) {
+  keyset_t *ks = &ctx->kset;
+  int curtab = 0;
+
+  for (int i = 0; i < ctx->tpath.top; i++) {
+    const char *key = ctx->tpath.key[i];
+    int n = keyset_find(ks, curtab, key);
+    switch (n >= 0 ? ks->node[n].kind : 0) {
+    case 't':
+      break;
+
+    case 'a':
+      /* the last table in the array */
+      if (ks->node[n].akind != 't' || ks->node[n].last < 0)
+        return e_internal(ctx, FLINE);
+      n = ks->node[n].last;
+      break;
+
+    case 'v':
+      return e_keyexists(ctx, ctx->tpath.tok[i].lineno);
+
+    default: /* Not found. Let's create an implicit table. */
+      if ((n = keyset_add(ctx, curtab, key, 't')) < 0)
+        return -1;
+      ks->node[n].implicit = true;
+      break;
+    }
+    curtab = n;
+  }
+
+  if (!llb) {
+    /* [x.y.z] -> create z = {} in x.y */
+    ctx->curnode = check_key(ctx, curtab, z, 't');
+    return ctx->curnode < 0 ? -1 : 0;
+  }
+
+  /* [[x.y.z]] -> create z = [] in x.y */
+  const char *zstr = normalize_key(ctx, z);
+  if (!zstr)
+    return -1;
+  int arr = keyset_find(ks, curtab, zstr);
+  if (arr < 0 || ks->node[arr].kind != 'a') {
+    if ((arr = check_key(ctx, curtab, z, 'a')) < 0)
+      return -1;
+    ks->node[arr].akind = 't';
+  }
+  if (ks->node[arr].akind != 't')
+    return e_syntax(ctx, z.lineno, "array mismatch");
+
+  /* add to z[] */
+  int n = keyset_add(ctx, arr, 0, 't');
+  if (n < 0)
+    return -1;
+  ks->node[arr].last = n;
+  ctx->curnode = n;
   return 0;
 }
 
@@ -1198,11 +2088,8 @@ static int fill_tabpath(context_t *ctx) {
   int i;
 
   /* clear tpath */
-  for (i = 0; i < ctx->tpath.top; i++) {
-    char **p = &ctx->tpath.key[i];
-    xfree(*p);
-    *p = 0;
-  }
+  for (i = 0; i < ctx->tpath.top; i++)
+    ctx->tpath.key[i] = 0;
   ctx->tpath.top = 0;
 
   for (;;) {
@@ -1213,7 +2100,7 @@ static int fill_tabpath(context_t *ctx) {
     if (ctx->tok.tok != STRING)
       return e_syntax(ctx, lineno, "invalid or missing key");
 
-    char *key = normalize_key(ctx, ctx->tok);
+    const char *key = normalize_key(ctx, ctx->tok);
     if (!key)
       return -1;
     ctx->tpath.tok[ctx->tpath.top] = ctx->tok;
@@ -1249,16 +2136,18 @@ static int walk_tabpath(context_t *ctx) {
   for (int i = 0; i < ctx->tpath.top; i++) {
     const char *key = ctx->tpath.key[i];
 
-    toml_keyval_t *nextval = 0;
     toml_array_t *nextarr = 0;
     toml_table_t *nexttab = 0;
-    switch (check_key(curtab, key, &nextval, &nextarr, &nexttab)) {
+    toml_tabent_t *e = find_entry(curtab, key);
+    switch (e ? e->kind : 0) {
     case 't':
       /* found a table. nexttab is where we will go next. */
+      nexttab = e->u.tab;
       break;
 
     case 'a':
       /* found an array. nexttab is the last table in the array. */
+      nextarr = e->u.arr;
       if (nextarr->kind != 't')
         return e_internal(ctx, FLINE);
 
@@ -1272,21 +2161,8 @@ static int walk_tabpath(context_t *ctx) {
       return e_keyexists(ctx, ctx->tpath.tok[i].lineno);
 
     default: { /* Not found. Let's create an implicit table. */
-      int n = curtab->ntab;
-      toml_table_t **base =
-          (toml_table_t **)expand_ptrarr((void **)curtab->tab, n);
-      if (0 == base)
-        return e_outofmemory(ctx, FLINE);
-
-      curtab->tab = base;
-
-      if (0 == (base[n] = (toml_table_t *)CALLOC(1, sizeof(*base[n]))))
-        return e_outofmemory(ctx, FLINE);
-
-      if (0 == (base[n]->key = STRDUP(key)))
-        return e_outofmemory(ctx, FLINE);
-
-      nexttab = curtab->tab[curtab->ntab++];
+      if (0 == (nexttab = add_table(ctx, curtab, key)))
+        return -1;
 
       /* tabs created by walk_tabpath are considered implicit */
       nexttab->implicit = true;
@@ -1324,17 +2200,33 @@ static int parse_select(context_t *ctx) {
   if (fill_tabpath(ctx))
     return -1;
 
+  /* [x.y.z] is nested 3 deep */
+  ctx->depth = 0;
+  for (int i = 0; i < ctx->tpath.top; i++) {
+    if (push_depth(ctx))
+      return -1;
+  }
+
+  /* find what to keep of x.y.z */
+  const toml_proj_t *proj = ctx->proj;
+  for (int i = 0; i < ctx->tpath.top && proj; i++)
+    proj = proj_child(proj, ctx->tpath.key[i]);
+  ctx->curproj = proj;
+
   /* For [x.y.z] or [[x.y.z]], remove z from tpath.
    */
   token_t z = ctx->tpath.tok[ctx->tpath.top - 1];
-  xfree(ctx->tpath.key[ctx->tpath.top - 1]);
   ctx->tpath.top--;
 
-  /* set up ctx->curtab */
-  if (walk_tabpath(ctx))
+  if (ctx->validate) {
+    if (check_select(ctx, z, llb))
+      return -1;
+  } else if (!proj) {
+    /* nothing to keep: the keyvals that follow will be dropped */
+    ctx->curtab = 0;
+  } else if (walk_tabpath(ctx)) { /* set up ctx->curtab */
     return -1;
-
-  if (!llb) {
+  } else if (!llb) {
     /* [x.y.z] -> create z = {} in x.y */
     toml_table_t *curtab = create_keytable_in_table(ctx, ctx->curtab, z);
     if (!curtab)
@@ -1344,11 +2236,10 @@ static int parse_select(context_t *ctx) {
     /* [[x.y.z]] -> create z = [] in x.y */
     toml_array_t *arr = 0;
     {
-      char *zstr = normalize_key(ctx, z);
+      const char *zstr = normalize_key(ctx, z);
       if (!zstr)
         return -1;
       arr = toml_array_in(ctx->curtab, zstr);
-      xfree(zstr);
     }
     if (!arr) {
       arr = create_keyarray_in_table(ctx, ctx->curtab, z, 't');
@@ -1365,7 +2256,7 @@ static int parse_select(context_t *ctx) {
       if (!t)
         return -1;
 
-      if (0 == (t->key = STRDUP("__anon__")))
+      if (0 == (t->key = keypool_add(ctx->keys, "__anon__", 8)))
         return e_outofmemory(ctx, FLINE);
 
       dest = t;
@@ -1394,8 +2285,13 @@ static int parse_select(context_t *ctx) {
   return 0;
 }
 
-toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
-  context_t ctx;
+/* Set up ctx for a parse with opts, and proj for its paths. Whether it
+ * fails or not, end_context() must be called afterwards.
+ */
+static int begin_context(context_t *ctx, toml_proj_t *proj,
+                         const toml_options_t *opts, bool validate,
+                         char *errbuf, int errbufsz) {
+  toml_keypool_t *keys = opts->keys;
 
   // clear errbuf
   if (errbufsz <= 0)
@@ -1403,179 +2299,1152 @@ toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
   if (errbufsz > 0)
     errbuf[0] = 0;
 
-  // init context
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.start = conf;
-  ctx.stop = ctx.start + strlen(conf);
-  ctx.errbuf = errbuf;
-  ctx.errbufsz = errbufsz;
+  // init context
+  memset(ctx, 0, sizeof(*ctx));
+  memset(proj, 0, sizeof(*proj));
+  ctx->errbuf = errbuf;
+  ctx->errbufsz = errbufsz;
+  ctx->opts = opts;
+  ctx->validate = validate;
+
+  ctx->watch = (opts->timeout_ms > 0 || opts->cancel);
+  if (opts->timeout_ms > 0)
+    ctx->deadline = now_ms() + opts->timeout_ms;
+
+  if (validate) {
+    // no tree: only a pool for the keys, and the root of the key set
+    ctx->proj = ctx->curproj = PROJ_ALL;
+    if (!(ctx->keys = toml_keypool_new()))
+      return e_outofmemory(ctx, FLINE);
+    ctx->curnode = keyset_add(ctx, -1, 0, 't');
+    return ctx->curnode < 0 ? -1 : 0;
+  }
+
+  // make a root table, and the pool for its keys unless one is given
+  if (0 == (ctx->root = CALLOC(1, sizeof(*ctx->root))))
+    return e_outofmemory(ctx, FLINE);
+  ctx->root->sharedkeys = (keys != 0);
+  if (!keys && !(keys = toml_keypool_new()))
+    return e_outofmemory(ctx, FLINE);
+  ctx->root->keys = ctx->keys = keys;
+
+  // make the trie of paths to keep
+  ctx->proj = PROJ_ALL;
+  if (opts->paths) {
+    for (const char *const *p = opts->paths; *p; p++) {
+      if (proj_add(ctx, proj, *p))
+        return -1;
+    }
+    ctx->proj = proj;
+  }
+
+  // set root as default table
+  ctx->curtab = ctx->root;
+  ctx->curproj = ctx->proj;
+  return 0;
+}
+
+/* Parse text[0..len-1], the next whole lines of the document, which
+ * start at line lineno and must not contain a NUL char.
+ */
+static int parse_lines(context_t *ctx, const char *text, size_t len,
+                       int lineno) {
+  ctx->start = (char *)(intptr_t)text; /* we never write to it */
+  ctx->stop = ctx->start + len;
+
+  // start with an artificial newline of length 0
+  ctx->tok.tok = NEWLINE;
+  ctx->tok.lineno = lineno;
+  ctx->tok.ptr = ctx->start;
+  ctx->tok.len = 0;
+  ctx->tok.eof = 0;
+
+  /* Scan forward until EOF */
+  for (token_t tok = ctx->tok; !tok.eof; tok = ctx->tok) {
+    switch (tok.tok) {
+
+    case NEWLINE:
+      if (next_token(ctx, 1))
+        return -1;
+      break;
+
+    case STRING:
+      if (ctx->validate ? check_keyval(ctx, ctx->curnode)
+                        : parse_keyval(ctx, ctx->curtab, ctx->curproj))
+        return -1;
+
+      if (ctx->tok.tok != NEWLINE)
+        return e_syntax(ctx, ctx->tok.lineno, "extra chars after value");
+
+      if (eat_token(ctx, NEWLINE, 1, FLINE))
+        return -1;
+      break;
+
+    case LBRACKET: /* [ x.y.z ] or [[ x.y.z ]] */
+      if (parse_select(ctx))
+        return -1;
+      break;
+
+    default:
+      return e_syntax(ctx, tok.lineno, "syntax error");
+    }
+  }
+  return 0;
+}
+
+/* Return the document, or free it and return 0 if the parse failed. */
+static toml_table_t *end_context(context_t *ctx, toml_proj_t *proj,
+                                 bool failed) {
+  const toml_options_t *opts = ctx->opts;
+  proj_free(proj);
+  if (!failed) {
+    if (opts->errcode)
+      *opts->errcode = 0;
+    return ctx->root;
+  }
+
+  // Something bad has happened. Free resources and return error.
+  toml_free(ctx->root);
+  if (opts->errcode)
+    *opts->errcode = ctx->errcode ? ctx->errcode : TOML_ERR_SYNTAX;
+  return 0;
+}
+
+/* Parse conf[0..len-1], which must not contain a NUL char. */
+static toml_table_t *parse_text(const char *conf, size_t len,
+                                const toml_options_t *opts, char *errbuf,
+                                int errbufsz) {
+  static const toml_options_t noopts;
+  context_t ctx;
+  toml_proj_t proj;
+
+  if (!opts)
+    opts = &noopts;
+
+  bool failed = begin_context(&ctx, &proj, opts, false, errbuf, errbufsz);
+  if (!failed && opts->max_bytes && len > opts->max_bytes)
+    failed = e_limit(&ctx, 1, "document is too large");
+  if (!failed)
+    failed = parse_lines(&ctx, conf, len, 1);
+  return end_context(&ctx, &proj, failed);
+}
+
+toml_table_t *toml_parse(char *conf, char *errbuf, int errbufsz) {
+  return parse_text(conf, strlen(conf), 0, errbuf, errbufsz);
+}
+
+/* The tokenizer stops at conf + len, but values are copied out as C
+ * strings, so a NUL inside the text would silently truncate them.
+ */
+static int check_nul(const char *conf, size_t len, char *errbuf,
+                     int errbufsz) {
+  const char *nul = memchr(conf, 0, len);
+  if (nul) {
+    int lineno = 1;
+    for (const char *p = conf; p < nul; p++)
+      lineno += (*p == '\n');
+    snprintf(errbuf, errbufsz, "line %d: NUL character in input", lineno);
+    return -1;
+  }
+  return 0;
+}
+
+toml_table_t *toml_parse_opts(const char *conf, size_t len,
+                              const toml_options_t *opts, char *errbuf,
+                              int errbufsz) {
+  if (check_nul(conf, len, errbuf, errbufsz)) {
+    if (opts && opts->errcode)
+      *opts->errcode = TOML_ERR_SYNTAX;
+    return 0;
+  }
+  return parse_text(conf, len, opts, errbuf, errbufsz);
+}
+
+int toml_validate(const char *conf, size_t len, char *errbuf, int errbufsz) {
+  static const toml_options_t noopts;
+  context_t ctx;
+  toml_proj_t proj;
+
+  if (check_nul(conf, len, errbuf, errbufsz))
+    return -1;
+
+  /* Only the keys are kept, to detect keys defined twice. */
+  bool failed = begin_context(&ctx, &proj, &noopts, true, errbuf, errbufsz);
+  if (!failed)
+    failed = parse_lines(&ctx, conf, len, 1);
+  keyset_free(&ctx.kset);
+  toml_keypool_free(ctx.keys);
+  return failed ? -1 : 0;
+}
+
+/* A document parsed as it arrives. The text is buffered until it holds
+ * whole statements; those are parsed into the tree and dropped from the
+ * buffer, so the buffer only holds the statement being received.
+ */
+struct toml_stream_t {
+  context_t ctx;
+  toml_proj_t proj;
+  toml_options_t opts; /* ctx.opts points here */
+  bool failed;
+  char err[200]; /* ctx.errbuf */
+
+  char *buf; /* text received but not parsed yet */
+  size_t len, cap;
+  size_t total; /* #bytes received */
+  int lineno;   /* line of buf[0] */
+
+  /* where stream_scan() stopped, and its state there */
+  size_t scanned;
+  int state; /* SCAN_* */
+  int depth; /* of [ and { */
+};
+
+enum {
+  SCAN_TEXT,
+  SCAN_COMMENT,
+  SCAN_BASIC,    /* "..." */
+  SCAN_LITERAL,  /* '...' */
+  SCAN_MLBASIC,  /* """...""" */
+  SCAN_MLLITERAL /* '''...''' */
+};
+
+/* Scan the buffer from where the last call stopped, and return the end of
+ * the last whole statement in it, or 0 if there is none. A statement ends
+ * at a newline that is not inside a string, an array or an inline table.
+ * Errors are left for the parser to report.
+ */
+static size_t stream_scan(toml_stream_t *st) {
+  const char *p = st->buf;
+  const size_t n = st->len;
+  size_t i = st->scanned;
+  size_t end = 0;
+
+  while (i < n) {
+    const int ch = p[i];
+    switch (st->state) {
+    case SCAN_TEXT:
+      if (ch == '"' || ch == '\'') {
+        if (i + 2 >= n)
+          goto out; /* cannot tell " from """ yet */
+        if (p[i + 1] == ch && p[i + 2] == ch) {
+          st->state = (ch == '"' ? SCAN_MLBASIC : SCAN_MLLITERAL);
+          i += 3;
+          continue;
+        }
+        st->state = (ch == '"' ? SCAN_BASIC : SCAN_LITERAL);
+      } else if (ch == '#') {
+        st->state = SCAN_COMMENT;
+      } else if (ch == '[' || ch == '{') {
+        st->depth++;
+      } else if (ch == ']' || ch == '}') {
+        if (st->depth > 0)
+          st->depth--;
+      } else if (ch == '\n' && st->depth == 0) {
+        end = i + 1;
+      }
+      i++;
+      continue;
+
+    case SCAN_COMMENT:
+    case SCAN_BASIC:
+    case SCAN_LITERAL:
+      if (ch == '\n') {
+        /* the line ends here, valid or not */
+        st->state = SCAN_TEXT;
+        continue;
+      }
+      if (st->state == SCAN_BASIC && ch == '\\') {
+        if (i + 1 >= n)
+          goto out;
+        i += 2;
+        continue;
+      }
+      if ((st->state == SCAN_BASIC && ch == '"') ||
+          (st->state == SCAN_LITERAL && ch == '\''))
+        st->state = SCAN_TEXT;
+      i++;
+      continue;
+
+    case SCAN_MLBASIC:
+    case SCAN_MLLITERAL: {
+      const int q = (st->state == SCAN_MLBASIC ? '"' : '\'');
+      if (q == '"' && ch == '\\') {
+        if (i + 1 >= n)
+          goto out;
+        i += 2;
+        continue;
+      }
+      if (ch != q) {
+        i++;
+        continue;
+      }
+      /* a run of 3 to 5 quotes closes the string */
+      size_t k = i;
+      while (k < n && p[k] == q)
+        k++;
+      if (k == n)
+        goto out; /* the run may go on */
+      if (k - i >= 3)
+        st->state = SCAN_TEXT;
+      i = k;
+      continue;
+    }
+    }
+  }
+
+out:
+  st->scanned = i;
+  return end;
+}
+
+static int stream_error(toml_stream_t *st, char *errbuf, int errbufsz) {
+  st->failed = true;
+  if (st->opts.errcode)
+    *st->opts.errcode =
+        st->ctx.errcode ? st->ctx.errcode : TOML_ERR_SYNTAX;
+  snprintf(errbuf, errbufsz, "%s", st->err);
+  return -1;
+}
+
+toml_stream_t *toml_stream_open(const toml_options_t *opts) {
+  toml_stream_t *st = CALLOC(1, sizeof(*st));
+  if (!st)
+    return 0;
+  if (opts)
+    st->opts = *opts;
+  st->lineno = 1;
+
+  /* a failure here is reported by the next call */
+  st->failed = begin_context(&st->ctx, &st->proj, &st->opts, false,
+                             st->err, sizeof(st->err));
+  return st;
+}
+
+int toml_stream_feed(toml_stream_t *st, const char *buf, size_t len,
+                     char *errbuf, int errbufsz) {
+  if (st->failed)
+    return stream_error(st, errbuf, errbufsz);
+
+  const char *nul = memchr(buf, 0, len);
+  if (nul) {
+    int lineno = st->lineno;
+    for (size_t i = 0; i < st->len; i++)
+      lineno += (st->buf[i] == '\n');
+    for (const char *p = buf; p < nul; p++)
+      lineno += (*p == '\n');
+    snprintf(st->err, sizeof(st->err), "line %d: NUL character in input",
+             lineno);
+    return stream_error(st, errbuf, errbufsz);
+  }
+
+  st->total += len;
+  if (st->opts.max_bytes && st->total > st->opts.max_bytes) {
+    e_limit(&st->ctx, st->lineno, "document is too large");
+    return stream_error(st, errbuf, errbufsz);
+  }
+
+  /* append to the buffer */
+  if (st->len + len > st->cap) {
+    size_t cap = st->cap ? st->cap : 4096;
+    while (cap < st->len + len)
+      cap *= 2;
+    char *x = MALLOC(cap);
+    if (!x) {
+      e_outofmemory(&st->ctx, FLINE);
+      return stream_error(st, errbuf, errbufsz);
+    }
+    if (st->len)
+      memcpy(x, st->buf, st->len);
+    xfree(st->buf);
+    st->buf = x;
+    st->cap = cap;
+  }
+  memcpy(st->buf + st->len, buf, len);
+  st->len += len;
+
+  /* parse the whole statements, and drop them */
+  size_t end = stream_scan(st);
+  if (end) {
+    if (parse_lines(&st->ctx, st->buf, end, st->lineno))
+      return stream_error(st, errbuf, errbufsz);
+    st->lineno = st->ctx.tok.lineno;
+    memmove(st->buf, st->buf + end, st->len - end);
+    st->len -= end;
+    st->scanned -= end;
+  }
+  return 0;
+}
+
+toml_table_t *toml_stream_finish(toml_stream_t *st, char *errbuf,
+                                 int errbufsz) {
+  if (!st->failed && parse_lines(&st->ctx, st->buf, st->len, st->lineno))
+    st->failed = true;
+  if (st->failed)
+    stream_error(st, errbuf, errbufsz);
+
+  toml_table_t *ret = end_context(&st->ctx, &st->proj, st->failed);
+  xfree(st->buf);
+  xfree(st);
+  return ret;
+}
+
+int toml_stream_take(toml_stream_t *st, const char *key, toml_table_t **ret,
+                     int n) {
+  if (st->failed)
+    return 0;
+  toml_array_t *arr = toml_array_in(st->ctx.root, key);
+  if (!arr || arr->kind != 't')
+    return 0;
+
+  /* all but the last table are complete: later headers can only add to
+   * the last one */
+  int k = arr->nitem - 1;
+  if (k > n)
+    k = n;
+  if (k <= 0)
+    return 0;
+  for (int i = 0; i < k; i++)
+    ret[i] = arr->item[i].tab;
+  memmove(arr->item, arr->item + k, (arr->nitem - k) * sizeof(*arr->item));
+  arr->nitem -= k;
+  return k;
+}
+
+void toml_stream_close(toml_stream_t *st) {
+  if (!st)
+    return;
+  proj_free(&st->proj);
+  toml_free(st->ctx.root);
+  xfree(st->buf);
+  xfree(st);
+}
+
+toml_table_t *toml_parse_keypool(const char *conf, size_t len,
+                                 toml_keypool_t *keys, char *errbuf,
+                                 int errbufsz) {
+  toml_options_t opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.keys = keys;
+  return toml_parse_opts(conf, len, &opts, errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_len(const char *conf, size_t len, char *errbuf,
+                             int errbufsz) {
+  return toml_parse_keypool(conf, len, 0, errbuf, errbufsz);
+}
+
+toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
+  int bufsz = 0;
+  char *buf = 0;
+  int off = 0;
+
+  /* read from fp into buf */
+  while (!feof(fp)) {
+
+    if (off == bufsz) {
+      int xsz = bufsz ? bufsz * 2 : 4096;
+      char *x = expand(buf, bufsz, xsz);
+      if (!x) {
+        snprintf(errbuf, errbufsz, "out of memory");
+        xfree(buf);
+        return 0;
+      }
+      buf = x;
+      bufsz = xsz;
+    }
+
+    errno = 0;
+    int n = fread(buf + off, 1, bufsz - off, fp);
+    if (ferror(fp)) {
+      snprintf(errbuf, errbufsz, "%s",
+               errno ? strerror(errno) : "Error reading file");
+      xfree(buf);
+      return 0;
+    }
+    off += n;
+  }
+
+  /* tag on a NUL to cap the string */
+  if (off == bufsz) {
+    int xsz = bufsz + 1;
+    char *x = expand(buf, bufsz, xsz);
+    if (!x) {
+      snprintf(errbuf, errbufsz, "out of memory");
+      xfree(buf);
+      return 0;
+    }
+    buf = x;
+    bufsz = xsz;
+  }
+  buf[off] = 0;
+
+  /* parse it, cleanup and finish */
+  toml_table_t *ret = toml_parse_len(buf, off, errbuf, errbufsz);
+  xfree(buf);
+  return ret;
+}
+
+static void xfree_tab(toml_table_t *p);
+
+static void xfree_arr(toml_array_t *p) {
+  if (!p)
+    return;
+
+  const bool own = !p->borrowed;
+  const int n = p->item ? p->nitem : 0;
+  for (int i = 0; i < n; i++) {
+    toml_arritem_t *a = &p->item[i];
+    if (a->val) {
+      if (own)
+        xfree(a->val);
+    } else if (a->arr)
+      xfree_arr(a->arr);
+    else if (a->tab)
+      xfree_tab(a->tab);
+  }
+  xfree(p->item);
+  if (own) {
+    xfree(p->pool);
+    xfree(p->off);
+    xfree(p->data);
+  }
+  xfree(p);
+}
+
+static void xfree_tab(toml_table_t *p) {
+  int i;
+
+  if (!p)
+    return;
+
+  for (i = 0; i < p->nent; i++) {
+    toml_tabent_t *e = &p->ent[i];
+    switch (e->kind) {
+    case 'v':
+      if (!p->borrowed)
+        xfree(e->u.val);
+      break;
+    case 'a':
+      xfree_arr(e->u.arr);
+      break;
+    case 't':
+      xfree_tab(e->u.tab);
+      break;
+    }
+  }
+  xfree(p->ent);
+  xfree(p->idx);
+  xfree(p);
+}
+
+void toml_free(toml_table_t *tab) {
+  if (!tab)
+    return;
+  /* keys are not freed with their nodes, but with the pool */
+  toml_keypool_t *keys = tab->sharedkeys ? 0 : tab->keys;
+  xfree_tab(tab);
+  toml_keypool_free(keys);
+}
+
+/*
+ * Binary images.
+ *
+ * An image is a flat copy of a tree, laid out in preorder. It holds no
+ * pointers, so it can be written to a file and mapped back in at any
+ * address. Numbers are stored in host byte order: an image is meant to be
+ * read back on the machine that wrote it.
+ *
+ *   header:  "TOMLIMG1", u32 0x01020304, u32 0, u64 total length
+ *   table:   str key, i32 nent, then per entry:
+ *              u8 'v', str key, str val | u8 'a', array | u8 't', table
+ *   array:   str key, u8 kind, u8 type, i32 nitem, u8 packed, then
+ *              packed:   i32 poolsz, pad4, i32 off[nitem], pool,
+ *                        pad8, int64_t/double data[nitem] if type i/d
+ *              unpacked: per item u8 valtype, then an entry as above
+ *                        without the key
+ *   str:     i32 len (-1 for none), len bytes, NUL
+ *
+ * Offsets are relative to the start of the image, which is 8-byte
+ * aligned, so a loaded tree can point at its strings and packed arrays
+ * in place.
+ */
+#define IMAGE_MAGIC "TOMLIMG1"
+#define IMAGE_HDRSZ 24
+#define IMAGE_MAXDEPTH 1000
+
+typedef struct image_writer_t image_writer_t;
+struct image_writer_t {
+  char *buf;
+  size_t bufsz;
+  size_t pos;
+};
+
+/* Append n bytes, or only count them if buf is full. */
+static void put(image_writer_t *w, const void *p, size_t n) {
+  if (w->pos + n <= w->bufsz)
+    memcpy(w->buf + w->pos, p, n);
+  w->pos += n;
+}
+
+static void put_u8(image_writer_t *w, int v) {
+  uint8_t b = v;
+  put(w, &b, 1);
+}
+
+static void put_i32(image_writer_t *w, int32_t v) { put(w, &v, sizeof(v)); }
+
+static void put_pad(image_writer_t *w, size_t align) {
+  while (w->pos % align)
+    put_u8(w, 0);
+}
+
+static void put_str(image_writer_t *w, const char *s) {
+  if (!s) {
+    put_i32(w, -1);
+    return;
+  }
+  size_t len = strlen(s);
+  put_i32(w, len);
+  put(w, s, len + 1);
+}
+
+static void put_tab(image_writer_t *w, const toml_table_t *tab);
+
+static void put_arr(image_writer_t *w, const toml_array_t *arr) {
+  const int n = arr->nitem;
+  put_str(w, arr->key);
+  put_u8(w, arr->kind);
+  put_u8(w, arr->type);
+  put_i32(w, n);
+  put_u8(w, arr->item == 0);
+
+  if (!arr->item) {
+    if (n == 0)
+      return;
+    int32_t poolsz = arr->off[n - 1] + strlen(arr->pool + arr->off[n - 1]) + 1;
+    put_i32(w, poolsz);
+    put_pad(w, 4);
+    for (int i = 0; i < n; i++)
+      put_i32(w, arr->off[i]);
+    put(w, arr->pool, poolsz);
+    if (arr->type == 'i' || arr->type == 'd') {
+      put_pad(w, 8);
+      put(w, arr->data, n * (size_t)8);
+    }
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    toml_arritem_t *a = &arr->item[i];
+    put_u8(w, a->valtype);
+    if (a->val) {
+      put_u8(w, 'v');
+      put_str(w, a->val);
+    } else if (a->arr) {
+      put_u8(w, 'a');
+      put_arr(w, a->arr);
+    } else {
+      put_u8(w, 't');
+      put_tab(w, a->tab);
+    }
+  }
+}
+
+static void put_tab(image_writer_t *w, const toml_table_t *tab) {
+  put_str(w, tab->key);
+  put_i32(w, tab->nent);
+  for (int i = 0; i < tab->nent; i++) {
+    toml_tabent_t *e = &tab->ent[i];
+    put_u8(w, e->kind);
+    switch (e->kind) {
+    case 'v':
+      put_str(w, e->key);
+      put_str(w, e->u.val);
+      break;
+    case 'a':
+      put_arr(w, e->u.arr); /* shares e->key */
+      break;
+    case 't':
+      put_tab(w, e->u.tab); /* shares e->key */
+      break;
+    }
+  }
+}
+
+size_t toml_image_write(const toml_table_t *tab, void *buf, size_t bufsz) {
+  image_writer_t w = {buf, bufsz, 0};
+  uint32_t bom = 0x01020304, zero = 0;
+  uint64_t total = 0;
+
+  put(&w, IMAGE_MAGIC, 8);
+  put(&w, &bom, 4);
+  put(&w, &zero, 4);
+  put(&w, &total, 8);
+  put_tab(&w, tab);
+
+  /* now that the length is known, fill it in */
+  total = w.pos;
+  if (total <= bufsz)
+    memcpy((char *)buf + 16, &total, 8);
+  return total;
+}
+
+typedef struct image_reader_t image_reader_t;
+struct image_reader_t {
+  const char *buf;
+  size_t len;
+  size_t pos;
+  int depth;
+};
+
+/* Return a pointer to the next n bytes and skip them, or 0 if the image
+ * is too short. */
+static const char *get(image_reader_t *r, size_t n) {
+  if (n > r->len - r->pos)
+    return 0;
+  const char *p = r->buf + r->pos;
+  r->pos += n;
+  return p;
+}
+
+static int get_u8(image_reader_t *r, int *ret) {
+  const char *p = get(r, 1);
+  if (!p)
+    return -1;
+  *ret = (uint8_t)*p;
+  return 0;
+}
+
+static int get_i32(image_reader_t *r, int32_t *ret) {
+  const char *p = get(r, sizeof(*ret));
+  if (!p)
+    return -1;
+  memcpy(ret, p, sizeof(*ret));
+  return 0;
+}
+
+static int get_pad(image_reader_t *r, size_t align) {
+  size_t n = (align - r->pos % align) % align;
+  return get(r, n) ? 0 : -1;
+}
+
+static int get_str(image_reader_t *r, const char **ret) {
+  int32_t len;
+  if (get_i32(r, &len))
+    return -1;
+  if (len == -1) {
+    *ret = 0;
+    return 0;
+  }
+  const char *p = len < 0 ? 0 : get(r, (size_t)len + 1);
+  if (!p || p[len])
+    return -1;
+  *ret = p;
+  return 0;
+}
+
+/* Read a count of things that take at least one byte each. */
+static int get_count(image_reader_t *r, int *ret) {
+  int32_t n;
+  if (get_i32(r, &n) || n < 0 || (size_t)n > r->len - r->pos)
+    return -1;
+  *ret = n;
+  return 0;
+}
+
+static toml_table_t *get_tab(image_reader_t *r);
+
+static toml_array_t *get_arr(image_reader_t *r) {
+  toml_array_t *arr = CALLOC(1, sizeof(*arr));
+  if (!arr)
+    return 0;
+  arr->borrowed = true;
+
+  int kind, type, n, packed;
+  if (r->depth++ >= IMAGE_MAXDEPTH || get_str(r, &arr->key) ||
+      get_u8(r, &kind) || get_u8(r, &type) || get_count(r, &n) ||
+      get_u8(r, &packed))
+    goto fail;
+  arr->kind = kind;
+  arr->type = type;
+
+  /* the readers of an array trust its kind and type to match its items */
+  if (n && !(kind == 'v' || kind == 'a' || kind == 't' || kind == 'm'))
+    goto fail;
+
+  if (packed) {
+    int32_t poolsz;
+    arr->nitem = n;
+    if (n == 0)
+      goto done;
+    /* only values of a single type are packed, see pack_array() */
+    if (kind != 'v' || !type || !strchr("sbidtDTu", type))
+      goto fail;
+    if (get_i32(r, &poolsz) || poolsz <= 0 || get_pad(r, 4))
+      goto fail;
+    arr->off = (int *)get(r, n * sizeof(int32_t));
+    arr->pool = (char *)get(r, poolsz);
+    if (!arr->off || !arr->pool || arr->pool[poolsz - 1])
+      goto fail;
+    for (int i = 0; i < n; i++) {
+      if (arr->off[i] < 0 || arr->off[i] >= poolsz)
+        goto fail;
+    }
+    if (type == 'i' || type == 'd') {
+      if (get_pad(r, 8) || !(arr->data = (void *)get(r, n * (size_t)8)))
+        goto fail;
+    }
+    goto done;
+  }
+
+  if (n && !(arr->item = CALLOC(n, sizeof(*arr->item))))
+    goto fail;
+  arr->capitem = n;
+  for (int i = 0; i < n; i++) {
+    toml_arritem_t *a = &arr->item[arr->nitem++];
+    int valtype, which;
+    if (get_u8(r, &valtype) || get_u8(r, &which))
+      goto fail;
+    if (kind != 'm' && which != kind)
+      goto fail;
+    a->valtype = valtype;
+    switch (which) {
+    case 'v':
+      if (get_str(r, (const char **)&a->val) || !a->val)
+        goto fail;
+      break;
+    case 'a':
+      if (!(a->arr = get_arr(r)))
+        goto fail;
+      break;
+    case 't':
+      if (!(a->tab = get_tab(r)))
+        goto fail;
+      break;
+    default:
+      goto fail;
+    }
+  }
+
+done:
+  r->depth--;
+  return arr;
 
-  // start with an artificial newline of length 0
-  ctx.tok.tok = NEWLINE;
-  ctx.tok.lineno = 1;
-  ctx.tok.ptr = conf;
-  ctx.tok.len = 0;
+fail:
+  xfree_arr(arr);
+  return 0;
+}
 
-  // make a root table
-  if (0 == (ctx.root = CALLOC(1, sizeof(*ctx.root)))) {
-    e_outofmemory(&ctx, FLINE);
-    // Do not goto fail, root table not set up yet
+static toml_table_t *get_tab(image_reader_t *r) {
+  toml_table_t *tab = CALLOC(1, sizeof(*tab));
+  if (!tab)
     return 0;
-  }
-
-  // set root as default table
-  ctx.curtab = ctx.root;
+  tab->borrowed = true;
+  tab->readonly = true;
 
-  /* Scan forward until EOF */
-  for (token_t tok = ctx.tok; !tok.eof; tok = ctx.tok) {
-    switch (tok.tok) {
+  int n;
+  if (r->depth++ >= IMAGE_MAXDEPTH || get_str(r, &tab->key) ||
+      get_count(r, &n))
+    goto fail;
+  if (n && !(tab->ent = CALLOC(n, sizeof(*tab->ent))))
+    goto fail;
+  tab->capent = n;
 
-    case NEWLINE:
-      if (next_token(&ctx, 1))
+  for (int i = 0; i < n; i++) {
+    toml_tabent_t *e = &tab->ent[tab->nent++];
+    int kind;
+    if (get_u8(r, &kind))
+      goto fail;
+    e->kind = kind;
+    switch (kind) {
+    case 'v':
+      if (get_str(r, &e->key) || !e->key ||
+          get_str(r, (const char **)&e->u.val) || !e->u.val)
         goto fail;
+      tab->nkval++;
       break;
-
-    case STRING:
-      if (parse_keyval(&ctx, ctx.curtab))
-        goto fail;
-
-      if (ctx.tok.tok != NEWLINE) {
-        e_syntax(&ctx, ctx.tok.lineno, "extra chars after value");
-        goto fail;
-      }
-
-      if (eat_token(&ctx, NEWLINE, 1, FLINE))
+    case 'a':
+      if (!(e->u.arr = get_arr(r)) || !(e->key = e->u.arr->key))
         goto fail;
+      tab->narr++;
       break;
-
-    case LBRACKET: /* [ x.y.z ] or [[ x.y.z ]] */
-      if (parse_select(&ctx))
+    case 't':
+      if (!(e->u.tab = get_tab(r)) || !(e->key = e->u.tab->key))
         goto fail;
+      tab->ntab++;
       break;
-
     default:
-      e_syntax(&ctx, tok.lineno, "syntax error");
       goto fail;
     }
+    e->hash = key_hash(e->key);
+  }
+
+  if (n >= INDEX_MIN) {
+    int cap = 4 * INDEX_MIN;
+    while (cap < 2 * n)
+      cap *= 2;
+    if (build_index(tab, cap))
+      goto fail;
   }
 
-  /* success */
-  for (int i = 0; i < ctx.tpath.top; i++)
-    xfree(ctx.tpath.key[i]);
-  return ctx.root;
+  r->depth--;
+  return tab;
 
 fail:
-  // Something bad has happened. Free resources and return error.
-  for (int i = 0; i < ctx.tpath.top; i++)
-    xfree(ctx.tpath.key[i]);
-  toml_free(ctx.root);
+  xfree_tab(tab);
   return 0;
 }
 
-toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz) {
-  int bufsz = 0;
-  char *buf = 0;
-  int off = 0;
+toml_table_t *toml_image_load(const void *image, size_t len, char *errbuf,
+                              int errbufsz) {
+  image_reader_t r = {image, len, 0, 0};
+  const char *hdr = get(&r, IMAGE_HDRSZ);
+  uint32_t bom;
+  uint64_t total;
 
-  /* read from fp into buf */
-  while (!feof(fp)) {
+  if ((uintptr_t)image % 8) {
+    snprintf(errbuf, errbufsz, "image is not aligned");
+    return 0;
+  }
+  if (!hdr || memcmp(hdr, IMAGE_MAGIC, 8)) {
+    snprintf(errbuf, errbufsz, "not an image");
+    return 0;
+  }
+  memcpy(&bom, hdr + 8, 4);
+  memcpy(&total, hdr + 16, 8);
+  if (bom != 0x01020304 || total != len) {
+    snprintf(errbuf, errbufsz, "image is corrupted or from another platform");
+    return 0;
+  }
 
-    if (off == bufsz) {
-      int xsz = bufsz + 1000;
-      char *x = expand(buf, bufsz, xsz);
-      if (!x) {
-        snprintf(errbuf, errbufsz, "out of memory");
-        xfree(buf);
-        return 0;
-      }
-      buf = x;
-      bufsz = xsz;
-    }
+  toml_table_t *tab = get_tab(&r);
+  if (!tab || r.pos != len) {
+    toml_free(tab);
+    snprintf(errbuf, errbufsz, "image is corrupted");
+    return 0;
+  }
+  return tab;
+}
 
-    errno = 0;
-    int n = fread(buf + off, 1, bufsz - off, fp);
-    if (ferror(fp)) {
-      snprintf(errbuf, errbufsz, "%s",
-               errno ? strerror(errno) : "Error reading file");
-      xfree(buf);
-      return 0;
-    }
-    off += n;
+/*
+ * MessagePack and CBOR.
+ *
+ * Both are written by one walk over the tree, through the image writer
+ * above, decoding each value straight into the output. fmt picks the
+ * encoding of each item. Numbers are big-endian in both.
+ */
+enum { FMT_MSGPACK, FMT_CBOR };
+
+static void put_be(image_writer_t *w, uint64_t v, int n) {
+  char b[8];
+  for (int i = n - 1; i >= 0; i--, v >>= 8)
+    b[i] = (char)(v & 0xff);
+  put(w, b, n);
+}
+
+/* CBOR: the head of an item of major type mt with argument n */
+static void cbor_head(image_writer_t *w, int mt, uint64_t n) {
+  mt <<= 5;
+  if (n < 24) {
+    put_u8(w, mt | (int)n);
+  } else if (n <= 0xff) {
+    put_u8(w, mt | 24);
+    put_be(w, n, 1);
+  } else if (n <= 0xffff) {
+    put_u8(w, mt | 25);
+    put_be(w, n, 2);
+  } else if (n <= 0xffffffff) {
+    put_u8(w, mt | 26);
+    put_be(w, n, 4);
+  } else {
+    put_u8(w, mt | 27);
+    put_be(w, n, 8);
   }
+}
 
-  /* tag on a NUL to cap the string */
-  if (off == bufsz) {
-    int xsz = bufsz + 1;
-    char *x = expand(buf, bufsz, xsz);
-    if (!x) {
-      snprintf(errbuf, errbufsz, "out of memory");
-      xfree(buf);
-      return 0;
-    }
-    buf = x;
-    bufsz = xsz;
+/* MessagePack: the head of a map, array or string of n items or bytes.
+ * The fix form holds up to fixmax items; the others have 8-bit (if
+ * op8), 16-bit and 32-bit lengths. */
+static void mp_head(image_writer_t *w, int fix, int fixmax, int op8, int op16,
+                    uint32_t n) {
+  if (n <= (uint32_t)fixmax) {
+    put_u8(w, fix | (int)n);
+  } else if (op8 && n <= 0xff) {
+    put_u8(w, op8);
+    put_be(w, n, 1);
+  } else if (n <= 0xffff) {
+    put_u8(w, op16);
+    put_be(w, n, 2);
+  } else {
+    put_u8(w, op16 + 1);
+    put_be(w, n, 4);
   }
-  buf[off] = 0;
+}
 
-  /* parse it, cleanup and finish */
-  toml_table_t *ret = toml_parse(buf, errbuf, errbufsz);
-  xfree(buf);
-  return ret;
+static void enc_map(image_writer_t *w, int fmt, int n) {
+  if (fmt == FMT_CBOR)
+    cbor_head(w, 5, n);
+  else
+    mp_head(w, 0x80, 15, 0, 0xde, n);
 }
 
-static void xfree_kval(toml_keyval_t *p) {
-  if (!p)
-    return;
-  xfree(p->key);
-  xfree(p->val);
-  xfree(p);
+static void enc_array(image_writer_t *w, int fmt, int n) {
+  if (fmt == FMT_CBOR)
+    cbor_head(w, 4, n);
+  else
+    mp_head(w, 0x90, 15, 0, 0xdc, n);
 }
 
-static void xfree_tab(toml_table_t *p);
+static void enc_str(image_writer_t *w, int fmt, const char *s, size_t len) {
+  if (fmt == FMT_CBOR)
+    cbor_head(w, 3, len);
+  else
+    mp_head(w, 0xa0, 31, 0xd9, 0xda, len);
+  put(w, s, len);
+}
 
-static void xfree_arr(toml_array_t *p) {
-  if (!p)
+static void enc_int(image_writer_t *w, int fmt, int64_t v) {
+  if (fmt == FMT_CBOR) {
+    if (v >= 0)
+      cbor_head(w, 0, v);
+    else
+      cbor_head(w, 1, -(uint64_t)(v + 1));
     return;
+  }
 
-  xfree(p->key);
-  const int n = p->nitem;
-  for (int i = 0; i < n; i++) {
-    toml_arritem_t *a = &p->item[i];
-    if (a->val)
-      xfree(a->val);
-    else if (a->arr)
-      xfree_arr(a->arr);
-    else if (a->tab)
-      xfree_tab(a->tab);
+  /* MessagePack: the smallest form that holds v */
+  if (-32 <= v && v <= 127) {
+    put_u8(w, (int)(v & 0xff));
+    return;
   }
-  xfree(p->item);
-  xfree(p);
+  int op, n;
+  if (v > 0) {
+    op = v <= 0xff ? 0xcc : v <= 0xffff ? 0xcd : v <= 0xffffffff ? 0xce : 0xcf;
+    n = 1 << (op - 0xcc);
+  } else {
+    op = v >= INT8_MIN    ? 0xd0
+         : v >= INT16_MIN ? 0xd1
+         : v >= INT32_MIN ? 0xd2
+                          : 0xd3;
+    n = 1 << (op - 0xd0);
+  }
+  put_u8(w, op);
+  put_be(w, (uint64_t)v, n);
 }
 
-static void xfree_tab(toml_table_t *p) {
-  int i;
+static void enc_double(image_writer_t *w, int fmt, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, 8);
+  put_u8(w, fmt == FMT_CBOR ? 0xfb : 0xcb);
+  put_be(w, bits, 8);
+}
 
-  if (!p)
-    return;
+static void enc_bool(image_writer_t *w, int fmt, int b) {
+  if (fmt == FMT_CBOR)
+    put_u8(w, b ? 0xf5 : 0xf4);
+  else
+    put_u8(w, b ? 0xc3 : 0xc2);
+}
+
+/* Encode raw, a value of type typ as given by valtype(). Dates and times
+ * are written as RFC 3339 text, tagged as such in CBOR if they have an
+ * offset. Return -1 if out of memory. */
+static int enc_value(image_writer_t *w, int fmt, const char *raw, int typ) {
+  int64_t i;
+  double d;
+  int b;
+  char *s;
+  toml_timestamp_t ts;
+
+  switch (typ) {
+  case 's':
+    if (toml_rtos(raw, &s))
+      return -1;
+    enc_str(w, fmt, s, strlen(s));
+    xfree(s);
+    return 0;
+  case 'i':
+    toml_rtoi(raw, &i);
+    enc_int(w, fmt, i);
+    return 0;
+  case 'd':
+    toml_rtod(raw, &d);
+    enc_double(w, fmt, d);
+    return 0;
+  case 'b':
+    toml_rtob(raw, &b);
+    enc_bool(w, fmt, b);
+    return 0;
+  }
+
+  char buf[64];
+  size_t len = strlen(raw);
+  if (len >= sizeof(buf))
+    len = sizeof(buf) - 1;
+  memcpy(buf, raw, len);
+  buf[len] = 0;
+  if (typ == 'T') {
+    buf[10] = 'T'; /* the date and time may be separated by a space */
+    if (fmt == FMT_CBOR && 0 == toml_rtots(raw, &ts) && ts.z)
+      cbor_head(w, 6, 0);
+  }
+  enc_str(w, fmt, buf, len);
+  return 0;
+}
 
-  xfree(p->key);
+static int enc_tab(image_writer_t *w, int fmt, const toml_table_t *tab);
 
-  for (i = 0; i < p->nkval; i++)
-    xfree_kval(p->kval[i]);
-  xfree(p->kval);
+static int enc_arr(image_writer_t *w, int fmt, const toml_array_t *arr) {
+  const int n = arr->nitem;
+  enc_array(w, fmt, n);
 
-  for (i = 0; i < p->narr; i++)
-    xfree_arr(p->arr[i]);
-  xfree(p->arr);
+  if (!arr->item) {
+    /* packed: ints and doubles are already decoded */
+    for (int i = 0; i < n; i++) {
+      if (arr->type == 'i')
+        enc_int(w, fmt, ((int64_t *)arr->data)[i]);
+      else if (arr->type == 'd')
+        enc_double(w, fmt, ((double *)arr->data)[i]);
+      else if (enc_value(w, fmt, arr->pool + arr->off[i], arr->type))
+        return -1;
+    }
+    return 0;
+  }
 
-  for (i = 0; i < p->ntab; i++)
-    xfree_tab(p->tab[i]);
-  xfree(p->tab);
+  for (int i = 0; i < n; i++) {
+    toml_arritem_t *a = &arr->item[i];
+    int rc = a->val   ? enc_value(w, fmt, a->val, a->valtype)
+             : a->arr ? enc_arr(w, fmt, a->arr)
+                      : enc_tab(w, fmt, a->tab);
+    if (rc)
+      return -1;
+  }
+  return 0;
+}
 
-  xfree(p);
+static int enc_tab(image_writer_t *w, int fmt, const toml_table_t *tab) {
+  enc_map(w, fmt, tab->nent);
+  for (int i = 0; i < tab->nent; i++) {
+    toml_tabent_t *e = &tab->ent[i];
+    enc_str(w, fmt, e->key, strlen(e->key));
+    int rc = e->kind == 'v'   ? enc_value(w, fmt, e->u.val, valtype(e->u.val))
+             : e->kind == 'a' ? enc_arr(w, fmt, e->u.arr)
+                              : enc_tab(w, fmt, e->u.tab);
+    if (rc)
+      return -1;
+  }
+  return 0;
+}
+
+size_t toml_msgpack_write(const toml_table_t *tab, void *buf, size_t bufsz) {
+  image_writer_t w = {buf, bufsz, 0};
+  return enc_tab(&w, FMT_MSGPACK, tab) ? 0 : w.pos;
 }
 
-void toml_free(toml_table_t *tab) { xfree_tab(tab); }
+size_t toml_cbor_write(const toml_table_t *tab, void *buf, size_t bufsz) {
+  image_writer_t w = {buf, bufsz, 0};
+  return enc_tab(&w, FMT_CBOR, tab) ? 0 : w.pos;
+}
 
 static void set_token(context_t *ctx, tokentype_t tok, int lineno, char *ptr,
                       int len) {
@@ -1630,17 +3499,33 @@ static int scan_time(const char *p, int *hh, int *mm, int *ss) {
   return (hour >= 0 && minute >= 0 && second >= 0) ? 0 : -1;
 }
 
+/* Return 1 if p starts with 3 ch's, without looking past ctx->stop. */
+static int is_triple(context_t *ctx, const char *p, int ch) {
+  return ctx->stop - p >= 3 && p[0] == ch && p[1] == ch && p[2] == ch;
+}
+
+/* Find the next 3 ch's at or after p. Return 0 if not found. */
+static char *find_triple(context_t *ctx, char *p, int ch) {
+  while ((p = memchr(p, ch, ctx->stop - p))) {
+    if (is_triple(ctx, p, ch))
+      return p;
+    p++;
+  }
+  return 0;
+}
+
 static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   char *orig = p;
-  if (0 == strncmp(p, "'''", 3)) {
+  char *stop = ctx->stop;
+  if (is_triple(ctx, p, '\'')) {
     char *q = p + 3;
 
     while (1) {
-      q = strstr(q, "'''");
+      q = find_triple(ctx, q, '\'');
       if (0 == q) {
         return e_syntax(ctx, lineno, "unterminated triple-s-quote");
       }
-      while (q[3] == '\'')
+      while (q + 3 < stop && q[3] == '\'')
         q++;
       break;
     }
@@ -1649,11 +3534,11 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
     return 0;
   }
 
-  if (0 == strncmp(p, "\"\"\"", 3)) {
+  if (is_triple(ctx, p, '"')) {
     char *q = p + 3;
 
     while (1) {
-      q = strstr(q, "\"\"\"");
+      q = find_triple(ctx, q, '"');
       if (0 == q) {
         return e_syntax(ctx, lineno, "unterminated triple-d-quote");
       }
@@ -1661,7 +3546,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
         q++;
         continue;
       }
-      while (q[3] == '\"')
+      while (q + 3 < stop && q[3] == '\"')
         q++;
       break;
     }
@@ -1708,9 +3593,9 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   }
 
   if ('\'' == *p) {
-    for (p++; *p && *p != '\n' && *p != '\''; p++)
+    for (p++; p < stop && *p != '\n' && *p != '\''; p++)
       ;
-    if (*p != '\'') {
+    if (p == stop || *p != '\'') {
       return e_syntax(ctx, lineno, "unterminated s-quote");
     }
 
@@ -1721,7 +3606,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   if ('\"' == *p) {
     int hexreq = 0; /* #hex required */
     int escape = 0;
-    for (p++; *p; p++) {
+    for (p++; p < stop; p++) {
       if (escape) {
         escape = 0;
         if (strchr("btnfr\"\\", *p))
@@ -1747,7 +3632,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
         continue;
       }
       if (*p == '\'') {
-        if (p[1] == '\'' && p[2] == '\'') {
+        if (is_triple(ctx, p, '\'')) {
           return e_syntax(ctx, lineno, "triple-s-quote inside string lit");
         }
         continue;
@@ -1757,7 +3642,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
       if (*p == '"')
         break;
     }
-    if (*p != '"') {
+    if (p == stop || *p != '"') {
       return e_syntax(ctx, lineno, "unterminated quote");
     }
 
@@ -1766,9 +3651,11 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   }
 
   /* check for timestamp without quotes */
-  if (0 == scan_date(p, 0, 0, 0) || 0 == scan_time(p, 0, 0, 0)) {
+  if ((stop - p >= 10 && 0 == scan_date(p, 0, 0, 0)) ||
+      (stop - p >= 8 && 0 == scan_time(p, 0, 0, 0))) {
     // forward thru the timestamp
-    p += strspn(p, "0123456789.:+-T Z");
+    while (p < stop && strchr("0123456789.:+-T Z", *p))
+      p++;
     // squeeze out any spaces at end of string
     for (; p[-1] == ' '; p--)
       ;
@@ -1778,7 +3665,7 @@ static int scan_string(context_t *ctx, char *p, int lineno, int dotisspecial) {
   }
 
   /* literals */
-  for (; *p && *p != '\n'; p++) {
+  for (; p < stop && *p != '\n'; p++) {
     int ch = *p;
     if (ch == '.' && dotisspecial)
       break;
@@ -1800,6 +3687,9 @@ static int next_token(context_t *ctx, int dotisspecial) {
   char *p = ctx->tok.ptr;
   int i;
 
+  if (ctx->watch && (++ctx->ntoken & 1023) == 0 && check_stop(ctx))
+    return -1;
+
   /* eat this tok */
   for (i = 0; i < ctx->tok.len; i++) {
     if (*p++ == '\n')
@@ -1850,7 +3740,11 @@ static int next_token(context_t *ctx, int dotisspecial) {
       continue;
     }
 
-    return scan_string(ctx, p, lineno, dotisspecial);
+    if (scan_string(ctx, p, lineno, dotisspecial))
+      return -1;
+    if (ctx->opts->max_strlen && ctx->tok.len > ctx->opts->max_strlen)
+      return e_limit(ctx, lineno, "string is too long");
+    return 0;
   }
 
   set_eof(ctx, lineno);
@@ -1858,66 +3752,53 @@ static int next_token(context_t *ctx, int dotisspecial) {
 }
 
 const char *toml_key_in(const toml_table_t *tab, int keyidx) {
-  if (keyidx < tab->nkval)
-    return tab->kval[keyidx]->key;
-
-  keyidx -= tab->nkval;
-  if (keyidx < tab->narr)
-    return tab->arr[keyidx]->key;
-
-  keyidx -= tab->narr;
-  if (keyidx < tab->ntab)
-    return tab->tab[keyidx]->key;
-
-  return 0;
+  return (0 <= keyidx && keyidx < tab->nent) ? tab->ent[keyidx].key : 0;
 }
 
 int toml_key_exists(const toml_table_t *tab, const char *key) {
-  int i;
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key))
-      return 1;
-  }
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key))
-      return 1;
-  }
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key))
-      return 1;
-  }
-  return 0;
+  return find_entry(tab, key) ? 1 : 0;
+}
+
+const char *toml_entry_in(const toml_table_t *tab, int keyidx,
+                          uint32_t *hash, const char **raw,
+                          toml_array_t **arr, toml_table_t **sub) {
+  *raw = 0;
+  *arr = 0;
+  *sub = 0;
+  if (!(0 <= keyidx && keyidx < tab->nent))
+    return 0;
+  const toml_tabent_t *e = &tab->ent[keyidx];
+  *hash = e->hash;
+  if (e->kind == 'v')
+    *raw = e->u.val;
+  else if (e->kind == 'a')
+    *arr = e->u.arr;
+  else
+    *sub = e->u.tab;
+  return e->key;
 }
 
+uint32_t toml_key_hash(const char *key) { return key_hash(key); }
+
 toml_raw_t toml_raw_in(const toml_table_t *tab, const char *key) {
-  int i;
-  for (i = 0; i < tab->nkval; i++) {
-    if (0 == strcmp(key, tab->kval[i]->key))
-      return tab->kval[i]->val;
-  }
-  return 0;
+  toml_tabent_t *e = find_entry(tab, key);
+  return (e && e->kind == 'v') ? e->u.val : 0;
 }
 
 toml_array_t *toml_array_in(const toml_table_t *tab, const char *key) {
-  int i;
-  for (i = 0; i < tab->narr; i++) {
-    if (0 == strcmp(key, tab->arr[i]->key))
-      return tab->arr[i];
-  }
-  return 0;
+  toml_tabent_t *e = find_entry(tab, key);
+  return (e && e->kind == 'a') ? e->u.arr : 0;
 }
 
 toml_table_t *toml_table_in(const toml_table_t *tab, const char *key) {
-  int i;
-  for (i = 0; i < tab->ntab; i++) {
-    if (0 == strcmp(key, tab->tab[i]->key))
-      return tab->tab[i];
-  }
-  return 0;
+  toml_tabent_t *e = find_entry(tab, key);
+  return (e && e->kind == 't') ? e->u.tab : 0;
 }
 
 toml_raw_t toml_raw_at(const toml_array_t *arr, int idx) {
-  return (0 <= idx && idx < arr->nitem) ? arr->item[idx].val : 0;
+  if (!(0 <= idx && idx < arr->nitem))
+    return 0;
+  return arr->item ? arr->item[idx].val : arr->pool + arr->off[idx];
 }
 
 char toml_array_kind(const toml_array_t *arr) { return arr->kind; }
@@ -1949,11 +3830,19 @@ const char *toml_table_key(const toml_table_t *tab) {
 }
 
 toml_array_t *toml_array_at(const toml_array_t *arr, int idx) {
-  return (0 <= idx && idx < arr->nitem) ? arr->item[idx].arr : 0;
+  return (0 <= idx && idx < arr->nitem && arr->item) ? arr->item[idx].arr : 0;
 }
 
 toml_table_t *toml_table_at(const toml_array_t *arr, int idx) {
-  return (0 <= idx && idx < arr->nitem) ? arr->item[idx].tab : 0;
+  return (0 <= idx && idx < arr->nitem && arr->item) ? arr->item[idx].tab : 0;
+}
+
+const int64_t *toml_int_data(const toml_array_t *arr) {
+  return (arr->kind == 'v' && arr->type == 'i') ? arr->data : 0;
+}
+
+const double *toml_double_data(const toml_array_t *arr) {
+  return (arr->kind == 'v' && arr->type == 'd') ? arr->data : 0;
 }
 
 static int parse_millisec(const char *p, const char **endp);
@@ -2077,6 +3966,21 @@ int toml_rtoi(toml_raw_t src, int64_t *ret_) {
   int64_t dummy;
   int64_t *ret = ret_ ? ret_ : &dummy;
 
+  /* fast path: plain decimal digits short enough that they cannot overflow */
+  {
+    const char *d = s + (s[0] == '+' || s[0] == '-');
+    if ('1' <= d[0] && d[0] <= '9') {
+      int64_t v = 0;
+      int n;
+      for (n = 0; n < 18 && '0' <= d[n] && d[n] <= '9'; n++)
+        v = v * 10 + (d[n] - '0');
+      if (d[n] == 0) {
+        *ret = (s[0] == '-' ? -v : v);
+        return 0;
+      }
+    }
+  }
+
   /* allow +/- */
   if (s[0] == '+' || s[0] == '-')
     *p++ = *s++;
@@ -2266,6 +4170,11 @@ toml_datum_t toml_bool_at(const toml_array_t *arr, int idx) {
 toml_datum_t toml_int_at(const toml_array_t *arr, int idx) {
   toml_datum_t ret;
   memset(&ret, 0, sizeof(ret));
+  if (arr->type == 'i' && arr->data) {
+    if ((ret.ok = (0 <= idx && idx < arr->nitem)))
+      ret.u.i = ((const int64_t *)arr->data)[idx];
+    return ret;
+  }
   ret.ok = (0 == toml_rtoi(toml_raw_at(arr, idx), &ret.u.i));
   return ret;
 }
@@ -2273,6 +4182,11 @@ toml_datum_t toml_int_at(const toml_array_t *arr, int idx) {
 toml_datum_t toml_double_at(const toml_array_t *arr, int idx) {
   toml_datum_t ret;
   memset(&ret, 0, sizeof(ret));
+  if (arr->type == 'd' && arr->data) {
+    if ((ret.ok = (0 <= idx && idx < arr->nitem)))
+      ret.u.d = ((const double *)arr->data)[idx];
+    return ret;
+  }
   ret.ok = (0 == toml_rtod(toml_raw_at(arr, idx), &ret.u.d));
   return ret;
 }
@@ -2307,6 +4221,178 @@ toml_datum_t toml_timestamp_at(const toml_array_t *arr, int idx) {
   return ret;
 }
 
+int toml_bool_array(const toml_array_t *arr, int *ret, int n) {
+  if (arr->nitem == 0)
+    return 0;
+  if (arr->kind != 'v' || arr->type != 'b' || arr->nitem > n)
+    return -1;
+
+  for (int i = 0; i < arr->nitem; i++) {
+    if (toml_rtob(toml_raw_at(arr, i), &ret[i]))
+      return -1;
+  }
+  return arr->nitem;
+}
+
+int toml_int_array(const toml_array_t *arr, int64_t *ret, int n) {
+  if (arr->nitem == 0)
+    return 0;
+  if (arr->kind != 'v' || arr->type != 'i' || arr->nitem > n)
+    return -1;
+
+  if (arr->data) {
+    memcpy(ret, arr->data, arr->nitem * sizeof(*ret));
+    return arr->nitem;
+  }
+
+  for (int i = 0; i < arr->nitem; i++) {
+    if (toml_rtoi(toml_raw_at(arr, i), &ret[i]))
+      return -1;
+  }
+  return arr->nitem;
+}
+
+int toml_double_array(const toml_array_t *arr, double *ret, int n) {
+  if (arr->nitem == 0)
+    return 0;
+  if (arr->kind != 'v' || arr->nitem > n)
+    return -1;
+
+  if (arr->type == 'd' && arr->data) {
+    memcpy(ret, arr->data, arr->nitem * sizeof(*ret));
+    return arr->nitem;
+  }
+
+  /* ints are accepted as doubles, same as toml_double_at() */
+  char buf[100];
+  for (int i = 0; i < arr->nitem; i++) {
+    if (toml_rtod_ex(toml_raw_at(arr, i), &ret[i], buf, sizeof(buf)))
+      return -1;
+  }
+  return arr->nitem;
+}
+
+int toml_array_columns(const toml_array_t *arr, const char *const *keys,
+                       int nkey, int first, int nrow, toml_raw_t *ret) {
+  if (arr->kind != 't' || first < 0 || nrow < 0 || nkey < 0)
+    return -1;
+  if (nrow > arr->nitem - first)
+    nrow = arr->nitem - first;
+  if (nrow <= 0 || nkey == 0)
+    return nrow > 0 ? nrow : 0;
+
+  /* Rows usually have the same keys in the same order. Remember where
+   * each key was found in the previous row, and try there first: its key
+   * is pooled, so a match is a pointer comparison. */
+  uint32_t *hash = MALLOC(nkey * sizeof(*hash));
+  int *hint = MALLOC(nkey * sizeof(*hint));
+  const char **seen = MALLOC(nkey * sizeof(*seen));
+  if (!hash || !hint || !seen) {
+    xfree(hash);
+    xfree(hint);
+    xfree(seen);
+    return -1;
+  }
+  for (int k = 0; k < nkey; k++) {
+    hash[k] = key_hash(keys[k]);
+    hint[k] = -1;
+    seen[k] = 0;
+  }
+
+  for (int i = 0; i < nrow; i++) {
+    const toml_table_t *tab = arr->item[first + i].tab;
+    toml_raw_t *row = &ret[(size_t)i * nkey];
+    for (int k = 0; k < nkey; k++) {
+      const toml_tabent_t *e = 0;
+      int h = hint[k];
+      if (0 <= h && h < tab->nent && tab->ent[h].key == seen[k]) {
+        e = &tab->ent[h];
+      } else if ((e = find_entry_hash(tab, keys[k], hash[k]))) {
+        hint[k] = e - tab->ent;
+        seen[k] = e->key;
+      }
+      row[k] = (e && e->kind == 'v') ? e->u.val : 0;
+    }
+  }
+
+  xfree(hash);
+  xfree(hint);
+  xfree(seen);
+  return nrow;
+}
+
+int toml_table_lookup(const toml_table_t *tab, const char *const *keys,
+                      const uint32_t *hashes, int nkey, toml_raw_t *ret) {
+  if (nkey <= 0)
+    return 0;
+  if (!tab) {
+    memset(ret, 0, nkey * sizeof(*ret));
+    return 0;
+  }
+  int found = 0;
+
+  /* An indexed table much larger than the list is better served by its
+   * index. */
+  if (tab->idx && 4 * nkey < tab->nent) {
+    for (int k = 0; k < nkey; k++) {
+      const toml_tabent_t *e = find_entry_hash(
+          tab, keys[k], hashes ? hashes[k] : key_hash(keys[k]));
+      ret[k] = (e && e->kind == 'v') ? e->u.val : 0;
+      found += !!ret[k];
+    }
+    return found;
+  }
+
+  /* Otherwise index the keys by hash, and match each entry against them
+   * in one pass. Each slot holds an index into keys[] plus 1, or 0. */
+  int cap = 16;
+  while (cap < 2 * nkey)
+    cap *= 2;
+  int stackslot[128];
+  uint32_t stackhash[64];
+  int *slot = stackslot;
+  uint32_t *hash = stackhash;
+  if (cap > 128) {
+    slot = MALLOC(cap * sizeof(*slot));
+    hash = MALLOC(nkey * sizeof(*hash));
+    if (!slot || !hash) {
+      xfree(slot);
+      xfree(hash);
+      return -1;
+    }
+  }
+  memset(slot, 0, cap * sizeof(*slot));
+  const int mask = cap - 1;
+  for (int k = 0; k < nkey; k++) {
+    ret[k] = 0;
+    hash[k] = hashes ? hashes[k] : key_hash(keys[k]);
+    int j = hash[k] & mask;
+    while (slot[j])
+      j = (j + 1) & mask;
+    slot[j] = k + 1;
+  }
+
+  for (int i = 0; i < tab->nent && found < nkey; i++) {
+    const toml_tabent_t *e = &tab->ent[i];
+    if (e->kind != 'v')
+      continue;
+    /* the same key may have been asked for more than once */
+    for (int j = e->hash & mask; slot[j]; j = (j + 1) & mask) {
+      int k = slot[j] - 1;
+      if (hash[k] == e->hash && !ret[k] && 0 == strcmp(keys[k], e->key)) {
+        ret[k] = e->u.val;
+        found++;
+      }
+    }
+  }
+
+  if (slot != stackslot) {
+    xfree(slot);
+    xfree(hash);
+  }
+  return found;
+}
+
 toml_datum_t toml_string_in(const toml_table_t *arr, const char *key) {
   toml_datum_t ret;
   memset(&ret, 0, sizeof(ret));
@@ -38,6 +38,9 @@ typedef struct toml_timestamp_t toml_timestamp_t;
 typedef struct toml_table_t toml_table_t;
 typedef struct toml_array_t toml_array_t;
 typedef struct toml_datum_t toml_datum_t;
+typedef struct toml_keypool_t toml_keypool_t;
+typedef struct toml_options_t toml_options_t;
+typedef struct toml_stream_t toml_stream_t;
 
 /* Parse a file. Return a table on success, or 0 otherwise.
  * Caller must toml_free(the-return-value) after use.
@@ -51,12 +54,155 @@ TOML_EXTERN toml_table_t *toml_parse_file(FILE *fp, char *errbuf, int errbufsz);
 TOML_EXTERN toml_table_t *toml_parse(char *conf, /* NUL terminated, please. */
                                      char *errbuf, int errbufsz);
 
+/* Same as toml_parse(), but parse the len bytes at conf in place. The
+ * text needs no terminating NUL and is not modified, and the returned
+ * table does not refer to it.
+ */
+TOML_EXTERN toml_table_t *toml_parse_len(const char *conf, size_t len,
+                                         char *errbuf, int errbufsz);
+
+/* Parse a document that arrives in pieces, e.g. from a socket. Each piece
+ * is parsed as soon as it completes a statement, and only the statement
+ * being received is buffered. opts may be 0; its timeout runs from
+ * toml_stream_open(). The key pool in opts->keys is only used during the
+ * calls below, so other parses may use it between them. Return 0 if out
+ * of memory.
+ */
+TOML_EXTERN toml_stream_t *toml_stream_open(const toml_options_t *opts);
+/* Add the next len bytes of the document. Return 0 on success, or -1
+ * with the error in errbuf; the stream must then be closed.
+ */
+TOML_EXTERN int toml_stream_feed(toml_stream_t *st, const char *buf,
+                                 size_t len, char *errbuf, int errbufsz);
+/* Parse the rest of the document and free the stream. Return the table,
+ * or 0 with the error in errbuf.
+ */
+TOML_EXTERN toml_table_t *toml_stream_finish(toml_stream_t *st, char *errbuf,
+                                             int errbufsz);
+/* For a document made of [[key]] tables, such as a data export, move up
+ * to n of the tables received so far out of the document into ret, so
+ * that memory stays bounded however many there are. Only tables that are
+ * complete are taken: all but the last, which remains in the document
+ * returned by toml_stream_finish(). Return the #tables taken; each must
+ * be freed with toml_free(). Their keys live in the key pool of the
+ * stream, so give it a pool in opts->keys to free them after the stream.
+ */
+TOML_EXTERN int toml_stream_take(toml_stream_t *st, const char *key,
+                                 toml_table_t **ret, int n);
+/* Free a stream that will not be finished. */
+TOML_EXTERN void toml_stream_close(toml_stream_t *st);
+
+/* Check that conf[0..len-1] is a valid document, as toml_parse_len()
+ * would, without building a tree: only the keys of each table are kept,
+ * to detect keys defined twice. Values are checked as well, while
+ * toml_parse() only checks them when they are read. Return 0 if the
+ * document is valid, or -1 with the first error in errbuf.
+ */
+TOML_EXTERN int toml_validate(const char *conf, size_t len, char *errbuf,
+                              int errbufsz);
+
+/* Keys are interned: each distinct key of a document is stored once, in
+ * a pool freed with the document. A pool made by toml_keypool_new() can
+ * instead be shared by several documents, so that keys they have in
+ * common are stored once. It must only be freed after all of them, and
+ * must not be used by two parses at the same time.
+ */
+TOML_EXTERN toml_keypool_t *toml_keypool_new(void);
+TOML_EXTERN void toml_keypool_free(toml_keypool_t *pool);
+
+/* Same as toml_parse_len(), but intern keys into the given pool. */
+TOML_EXTERN toml_table_t *toml_parse_keypool(const char *conf, size_t len,
+                                             toml_keypool_t *keys,
+                                             char *errbuf, int errbufsz);
+
+/* Options of toml_parse_opts(). Zero the struct, then set the fields
+ * needed.
+ */
+struct toml_options_t {
+  /* intern keys into this pool; see toml_parse_keypool(). */
+  toml_keypool_t *keys;
+
+  /* If not 0, a 0-terminated list of dotted key paths, e.g. "server" and
+   * "database.pool". Only the entries under these paths, and the tables
+   * and arrays leading to them, are kept. A path into an array of tables
+   * applies to each of its tables. The rest of the document is checked
+   * for syntax, but nothing is allocated for it, and keys defined twice
+   * in it are not detected. Keys in a path are taken as is; they are not
+   * quoted and cannot contain a dot.
+   */
+  const char *const *paths;
+
+  /* Limits for untrusted input, 0 for none. A parse that exceeds one
+   * fails with TOML_ERR_LIMIT. The memory counted is that of the tree,
+   * and is approximate.
+   */
+  size_t max_bytes;  /* length of the text */
+  int max_nodes;     /* #values, arrays and tables */
+  size_t max_memory; /* bytes allocated for the tree */
+  int max_depth;     /* nesting of tables and arrays */
+  int max_strlen;    /* length of a key or value as written */
+
+  /* If set, give up with TOML_ERR_TIMEOUT after timeout_ms, or with
+   * TOML_ERR_CANCELLED once cancel(cancel_arg) returns non-zero. Both are
+   * checked every 1024 tokens.
+   */
+  int timeout_ms;
+  int (*cancel)(void *arg);
+  void *cancel_arg;
+
+  /* If not 0, set to 0 on success, or to the TOML_ERR_* code of the error
+   * on failure.
+   */
+  int *errcode;
+};
+
+#define TOML_ERR_SYNTAX 1    /* not a valid document */
+#define TOML_ERR_NOMEM 2     /* out of memory */
+#define TOML_ERR_INTERNAL 3  /* bug */
+#define TOML_ERR_LIMIT 4     /* a limit in toml_options_t was exceeded */
+#define TOML_ERR_TIMEOUT 5   /* timeout_ms in toml_options_t has passed */
+#define TOML_ERR_CANCELLED 6 /* cancel in toml_options_t returned true */
+
+/* Same as toml_parse_len(), with options. opts may be 0. */
+TOML_EXTERN toml_table_t *toml_parse_opts(const char *conf, size_t len,
+                                          const toml_options_t *opts,
+                                          char *errbuf, int errbufsz);
+
 /* Free the table returned by toml_parse() or toml_parse_file(). Once
  * this function is called, any handles accessed through this tab
  * directly or indirectly are no longer valid.
  */
 TOML_EXTERN void toml_free(toml_table_t *tab);
 
+/* Write tab as a binary image into buf, if it fits in bufsz bytes.
+ * Return the size of the image; if that is more than bufsz, call again
+ * with a larger buf. The image holds no pointers, so it may be saved to a
+ * file and loaded later by another process on the same platform.
+ */
+TOML_EXTERN size_t toml_image_write(const toml_table_t *tab, void *buf,
+                                    size_t bufsz);
+
+/* Rebuild a table from an image made by toml_image_write(), without
+ * parsing. The image must be 8-byte aligned. The table refers to strings
+ * and arrays inside the image, so the image must stay valid and unchanged
+ * until the table is freed with toml_free(). Return 0 if the image is
+ * not valid.
+ */
+TOML_EXTERN toml_table_t *toml_image_load(const void *image, size_t len,
+                                          char *errbuf, int errbufsz);
+
+/* Write tab as MessagePack or CBOR into buf, if it fits in bufsz bytes.
+ * As with toml_image_write(), return the size of the encoding, and call
+ * again with a larger buf if that is more than bufsz; return 0 if out
+ * of memory. Tables become maps, in the order their keys were defined.
+ * Dates and times become RFC 3339 strings, and in CBOR, those with an
+ * offset are tagged as date/time (tag 0).
+ */
+TOML_EXTERN size_t toml_msgpack_write(const toml_table_t *tab, void *buf,
+                                      size_t bufsz);
+TOML_EXTERN size_t toml_cbor_write(const toml_table_t *tab, void *buf,
+                                   size_t bufsz);
+
 /* Timestamp types. The year, month, day, hour, minute, second, z
  * fields may be NULL if they are not relevant. e.g. In a DATE
  * type, the hour, minute, second and z fields will be NULLs.
@@ -95,15 +241,41 @@ TOML_EXTERN toml_datum_t toml_bool_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_int_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_double_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_datum_t toml_timestamp_at(const toml_array_t *arr, int idx);
+/* ... retrieve all values of a value array into ret[0..n-1] in one call.
+ * Return the #elements stored, or -1 if n is too small or if any element
+ * has a different type.
+ */
+TOML_EXTERN int toml_bool_array(const toml_array_t *arr, int *ret, int n);
+TOML_EXTERN int toml_int_array(const toml_array_t *arr, int64_t *ret, int n);
+TOML_EXTERN int toml_double_array(const toml_array_t *arr, double *ret, int n);
+/* ... for an array of ints (or doubles), return the decoded values
+ * stored contiguously in the array, or 0 if the array has other types.
+ * Also return 0 for an array whose text is too large to be packed (over
+ * 2GB); use toml_int_array() or toml_double_array() for those. The
+ * pointer is valid until toml_free(). The raw text of each element is
+ * kept as well, for toml_raw_at(), so packing takes about a third of the
+ * memory of separate elements, and only once the array is parsed.
+ */
+TOML_EXTERN const int64_t *toml_int_data(const toml_array_t *arr);
+TOML_EXTERN const double *toml_double_data(const toml_array_t *arr);
 /* ... retrieve array or table using index. */
 TOML_EXTERN toml_array_t *toml_array_at(const toml_array_t *arr, int idx);
 TOML_EXTERN toml_table_t *toml_table_at(const toml_array_t *arr, int idx);
 
 /* on tables: */
-/* ... retrieve the key in table at keyidx. Return 0 if out of range. */
+/* ... retrieve the key in table at keyidx. Return 0 if out of range.
+ *     Keys are numbered in the order they were defined. */
 TOML_EXTERN const char *toml_key_in(const toml_table_t *tab, int keyidx);
 /* ... returns 1 if key exists in tab, 0 otherwise */
 TOML_EXTERN int toml_key_exists(const toml_table_t *tab, const char *key);
+/* ... walk the table in one pass: return the key at keyidx, like
+ *     toml_key_in(), and set *hash to toml_key_hash() of it. Set one of
+ *     *raw, *arr or *sub to what the entry holds, and the others to 0. */
+TOML_EXTERN const char *toml_entry_in(const toml_table_t *tab, int keyidx,
+                                      uint32_t *hash, const char **raw,
+                                      toml_array_t **arr, toml_table_t **sub);
+/* ... the hash of a key (32-bit FNV-1a), as kept for each entry. */
+TOML_EXTERN uint32_t toml_key_hash(const char *key);
 /* ... retrieve values using key. */
 TOML_EXTERN toml_datum_t toml_string_in(const toml_table_t *arr,
                                         const char *key);
@@ -161,6 +333,26 @@ TOML_EXTERN void toml_set_memutil(void *(*xxmalloc)(size_t),
 typedef const char *toml_raw_t;
 TOML_EXTERN toml_raw_t toml_raw_in(const toml_table_t *tab, const char *key);
 TOML_EXTERN toml_raw_t toml_raw_at(const toml_array_t *arr, int idx);
+/* For an array of tables, look up nkey keys in nrow tables starting at
+ * index first, in one pass. Store the raw value of keys[k] in table
+ * first+i into ret[i * nkey + k], or 0 if that table has no value for the
+ * key. Return the #rows done, or -1 if arr is not an array of tables.
+ */
+TOML_EXTERN int toml_array_columns(const toml_array_t *arr,
+                                   const char *const *keys, int nkey,
+                                   int first, int nrow, toml_raw_t *ret);
+/* Look up nkey keys in tab at once. Store the raw value of keys[k] in
+ * ret[k], or 0 if tab has no value for the key. Return the #keys found,
+ * or -1 if out of memory. Unless tab is much larger than the list, this
+ * takes a single pass over the entries of tab. hashes may give
+ * toml_key_hash() of each key, to save hashing them again when the same
+ * keys are looked up in many tables; otherwise pass 0. A tab of 0 has no
+ * values.
+ */
+TOML_EXTERN int toml_table_lookup(const toml_table_t *tab,
+                                  const char *const *keys,
+                                  const uint32_t *hashes, int nkey,
+                                  toml_raw_t *ret);
 TOML_EXTERN int toml_rtos(toml_raw_t s, char **ret);
 TOML_EXTERN int toml_rtob(toml_raw_t s, int *ret);
 TOML_EXTERN int toml_rtoi(toml_raw_t s, int64_t *ret);
@@ -0,0 +1,471 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/*
+ *  Usage: toml_codegen NAME [schema.toml]
+ *
+ *  Write to stdout a C++ header that declares struct NAME, shaped after
+ *  the schema, and a function
+ *
+ *      bool load(const toml::Table &tab, NAME &ret, std::string &errmsg);
+ *
+ *  that fills it from a document in a single pass over each table. In the
+ *  schema, each key names a field and gives its type:
+ *
+ *      host = "string"                         # required
+ *      port = { type = "int", default = 8080 } # optional
+ *      [tls]                                   # nested struct
+ *      [[backend]]                             # vector of structs
+ *
+ *  The types are string, int, double, bool and timestamp, and arrays of
+ *  them as string[], int[] and so on. A table is only taken as a default
+ *  when it holds exactly type and default.
+ */
+
+#include "toml.h"
+#include "tomlcpp.hpp"
+#include <cctype>
+#include <errno.h>
+#include <fstream>
+#include <inttypes.h>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::string;
+using std::vector;
+
+struct Struct;
+
+struct Field {
+  string key;
+  char kind = 'v';    // 'v'alue, 't'able, or array of tables 'a'
+  string type;        // for values: string, int, double, bool or timestamp
+  bool array = false; // for values: a vector of type
+  bool required = false;
+  string init; // default, as a C++ initializer
+  std::unique_ptr<Struct> sub;
+};
+
+struct Struct {
+  string name; // C++ type, qualified
+  vector<Field> fields;
+};
+
+static void fatal(const string &msg) {
+  cerr << "ERROR: " << msg << "\n";
+  exit(1);
+}
+
+// The C++ keywords, which cannot name a field or a struct
+static const char *const KEYWORDS[] = {
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+    "bool", "break", "case", "catch", "char", "char16_t", "char32_t", "char8_t",
+    "class", "co_await", "co_return", "co_yield", "compl", "concept", "const",
+    "const_cast", "consteval", "constexpr", "constinit", "continue", "decltype",
+    "default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+    "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+    "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+    "not", "not_eq", "nullptr", "operator", "or", "or_eq", "private",
+    "protected", "public", "register", "reinterpret_cast", "requires", "return",
+    "short", "signed", "sizeof", "static", "static_assert", "static_cast",
+    "struct", "switch", "template", "this", "thread_local", "throw", "true",
+    "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+    "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq",
+};
+
+static bool is_identifier(const char *s) {
+  for (const char *kw : KEYWORDS) {
+    if (0 == strcmp(s, kw))
+      return false;
+  }
+  if (!(isalpha(*s) || *s == '_'))
+    return false;
+  for (s++; *s; s++) {
+    if (!(isalnum(*s) || *s == '_'))
+      return false;
+  }
+  return true;
+}
+
+static string cxx_type(const Field &f) {
+  string t = f.type == "string"      ? "std::string"
+             : f.type == "int"       ? "int64_t"
+             : f.type == "timestamp" ? "toml::Timestamp"
+                                     : f.type;
+  return f.array ? "std::vector<" + t + ">" : t;
+}
+
+static string quote(const string &s) {
+  string ret = "\"";
+  for (unsigned char ch : s) {
+    char buf[8];
+    if (ch == '"' || ch == '\\') {
+      ret += '\\';
+      ret += ch;
+    } else if (ch < 0x20 || ch >= 0x7f) {
+      snprintf(buf, sizeof(buf), "\\%03o", ch);
+      ret += buf;
+    } else {
+      ret += ch;
+    }
+  }
+  return ret + "\"";
+}
+
+// The C++ literal of raw, a value of type. Return "" if it is not one.
+static string literal(const char *raw, const string &type) {
+  char buf[64];
+  if (type == "string") {
+    char *s;
+    if (!raw || toml_rtos(raw, &s))
+      return "";
+    string ret = quote(s);
+    free(s);
+    return ret;
+  }
+  if (type == "int") {
+    int64_t i;
+    if (!raw || toml_rtoi(raw, &i))
+      return "";
+    if (i == INT64_MIN)
+      return "INT64_MIN";
+    snprintf(buf, sizeof(buf), "INT64_C(%" PRId64 ")", i);
+    return buf;
+  }
+  if (type == "double") {
+    double d;
+    if (!raw || toml_rtod(raw, &d))
+      return "";
+    if (isnan(d))
+      return "std::numeric_limits<double>::quiet_NaN()";
+    if (isinf(d))
+      return d < 0 ? "-std::numeric_limits<double>::infinity()"
+                   : "std::numeric_limits<double>::infinity()";
+    snprintf(buf, sizeof(buf), "%.17g", d);
+    return buf;
+  }
+  if (type == "bool") {
+    int b;
+    if (!raw || toml_rtob(raw, &b))
+      return "";
+    return b ? "true" : "false";
+  }
+  return "";
+}
+
+static void parse_type(Field &f, const string &path, const char *raw) {
+  char *s;
+  if (!raw || toml_rtos(raw, &s))
+    fatal(path + ": expected a type name");
+  f.type = s;
+  free(s);
+  if (f.type.size() > 2 && f.type.substr(f.type.size() - 2) == "[]") {
+    f.array = true;
+    f.type.resize(f.type.size() - 2);
+  }
+  if (f.type != "string" && f.type != "int" && f.type != "double" &&
+      f.type != "bool" && f.type != "timestamp")
+    fatal(path + ": unknown type " + f.type);
+}
+
+// A table of exactly type and default describes an optional field. Any
+// other table is a nested struct, even one with a field named type.
+static bool is_descriptor(const toml_table_t *tab) {
+  return toml_raw_in(tab, "type") && toml_key_exists(tab, "default") &&
+         !toml_key_in(tab, 2);
+}
+
+static void parse_default(Field &f, const string &path,
+                          const toml_table_t *tab) {
+  if (f.type == "timestamp")
+    fatal(path + ": a timestamp cannot have a default");
+  if (!f.array) {
+    f.init = literal(toml_raw_in(tab, "default"), f.type);
+    if (f.init.empty())
+      fatal(path + ": default is not of type " + f.type);
+    return;
+  }
+  toml_array_t *arr = toml_array_in(tab, "default");
+  if (!arr)
+    fatal(path + ": default is not an array");
+  for (int i = 0; i < toml_array_nelem(arr); i++) {
+    string v = literal(toml_raw_at(arr, i), f.type);
+    if (v.empty())
+      fatal(path + ": default is not an array of " + f.type);
+    f.init += (i ? ", " : "") + v;
+  }
+}
+
+static std::unique_ptr<Struct> parse_struct(const toml_table_t *tab,
+                                            const string &name,
+                                            const string &path) {
+  auto ret = std::make_unique<Struct>();
+  ret->name = name;
+  uint32_t hash;
+  const char *raw;
+  toml_array_t *arr;
+  toml_table_t *sub;
+  for (int i = 0; const char *key = toml_entry_in(tab, i, &hash, &raw, &arr,
+                                                  &sub);
+       i++) {
+    const string fpath = path + key;
+    if (!is_identifier(key))
+      fatal(fpath + ": key is not a C++ identifier");
+    Field f;
+    f.key = key;
+    if (raw) {
+      parse_type(f, fpath, raw);
+      f.required = true;
+    } else if (sub && is_descriptor(sub)) {
+      parse_type(f, fpath, toml_raw_in(sub, "type"));
+      parse_default(f, fpath, sub);
+    } else if (sub) {
+      f.kind = 't';
+      f.sub = parse_struct(sub, name + "::" + f.key + "_t", fpath + ".");
+    } else if (toml_array_kind(arr) == 't' && toml_array_nelem(arr) == 1) {
+      f.kind = 'a';
+      f.sub = parse_struct(toml_table_at(arr, 0), name + "::" + f.key + "_t",
+                           fpath + ".");
+    } else {
+      fatal(fpath + ": expected a type, a table or one [[table]]");
+    }
+    ret->fields.push_back(std::move(f));
+  }
+  return ret;
+}
+
+// Whether loading s can fail for lack of a field
+static bool has_required(const Struct &s) {
+  for (const auto &f : s.fields) {
+    if (f.required || (f.kind == 't' && has_required(*f.sub)))
+      return true;
+  }
+  return false;
+}
+
+static void print_struct(const Struct &s, const string &indent) {
+  string name = s.name.substr(s.name.rfind(':') + 1);
+  printf("%sstruct %s {\n", indent.c_str(), name.c_str());
+  for (const auto &f : s.fields) {
+    if (f.sub)
+      print_struct(*f.sub, indent + "  ");
+  }
+  for (const auto &f : s.fields) {
+    string type = f.kind == 'v' ? cxx_type(f)
+                  : f.kind == 't'
+                      ? f.key + "_t"
+                      : "std::vector<" + f.key + "_t>";
+    string init;
+    if (!f.init.empty())
+      init = f.array ? " = {" + f.init + "}" : " = " + f.init;
+    else if (f.kind == 'v' && !f.array &&
+             (f.type == "int" || f.type == "double" || f.type == "bool"))
+      init = " = {}";
+    printf("%s  %s %s%s;\n", indent.c_str(), type.c_str(), f.key.c_str(),
+           init.c_str());
+  }
+  printf("%s};\n", indent.c_str());
+}
+
+// The statements that load field f from the entry, which is known to be
+// f.key; seen is the index in seen[] or -1.
+static void print_field(const Field &f, int seen) {
+  const char *k = f.key.c_str();
+  if (f.kind == 'v' && !f.array) {
+    printf("        if (!raw || !toml::decode(raw, ret.%s))\n", k);
+    printf("          return fail(errmsg, \"%s\", \"expected %s\");\n", k,
+           f.type.c_str());
+  } else if (f.kind == 'v') {
+    const char *get = f.type == "string"   ? "String"
+                      : f.type == "int"    ? "Int"
+                      : f.type == "double" ? "Double"
+                      : f.type == "bool"   ? "Bool"
+                                           : "Timestamp";
+    printf("        if (!arr || !toml::ArrayRef(arr).get%sVector(ret.%s))\n",
+           get, k);
+    printf("          return fail(errmsg, \"%s\", \"expected %s[]\");\n", k,
+           f.type.c_str());
+  } else if (f.kind == 't') {
+    printf("        if (!sub)\n");
+    printf("          return fail(errmsg, \"%s\", \"expected a table\");\n",
+           k);
+    printf("        if (!load(sub, ret.%s, errmsg))\n", k);
+    printf("          return nest(errmsg, \"%s.\");\n", k);
+  } else {
+    printf("        if (!arr || (toml_array_nelem(arr) &&\n");
+    printf("                     toml_array_kind(arr) != 't'))\n");
+    printf("          return fail(errmsg, \"%s\", \"expected [[%s]]\");\n", k,
+           k);
+    printf("        ret.%s.resize(toml_array_nelem(arr));\n", k);
+    printf("        for (int j = 0; j < toml_array_nelem(arr); j++) {\n");
+    printf("          if (!load(toml_table_at(arr, j), ret.%s[j], errmsg))\n",
+           k);
+    printf("            return nest(errmsg, \"%s[\" + std::to_string(j) + "
+           "\"].\");\n",
+           k);
+    printf("        }\n");
+  }
+  if (seen >= 0)
+    printf("        seen[%d] = true;\n", seen);
+}
+
+static void print_loader(const Struct &s) {
+  for (const auto &f : s.fields) {
+    if (f.sub)
+      print_loader(*f.sub);
+  }
+
+  // the fields that must be checked for after the loop
+  std::map<const Field *, int> seen;
+  for (const auto &f : s.fields) {
+    if (f.required || (f.kind == 't' && has_required(*f.sub))) {
+      int n = seen.size();
+      seen[&f] = n;
+    }
+  }
+  // the fields by hash; keys with the same hash share a case
+  std::map<uint32_t, vector<const Field *>> cases;
+  for (const auto &f : s.fields)
+    cases[toml_key_hash(f.key.c_str())].push_back(&f);
+
+  printf("inline bool load(const toml_table_t *tab, %s &ret,\n",
+         s.name.c_str());
+  printf("                 std::string &errmsg) {\n");
+  if (!seen.empty())
+    printf("  bool seen[%zu] = {};\n", seen.size());
+  if (!s.fields.empty()) {
+    printf("  uint32_t hash;\n");
+    printf("  const char *key, *raw;\n");
+    printf("  toml_array_t *arr;\n");
+    printf("  toml_table_t *sub;\n");
+    printf("  for (int i = 0;\n");
+    printf("       tab && (key = toml_entry_in(tab, i, &hash, &raw, &arr, "
+           "&sub));\n");
+    printf("       i++) {\n");
+    printf("    switch (hash) {\n");
+    for (const auto &c : cases) {
+      printf("    case 0x%08" PRIx32 "u:\n", c.first);
+      for (size_t j = 0; j < c.second.size(); j++) {
+        const Field &f = *c.second[j];
+        printf("      %sif (!strcmp(key, \"%s\")) {\n", j ? "} else " : "",
+               f.key.c_str());
+        print_field(f, seen.count(&f) ? seen[&f] : -1);
+      }
+      printf("      }\n");
+      printf("      break;\n");
+    }
+    printf("    }\n");
+    printf("  }\n");
+  }
+  for (const auto &f : s.fields) {
+    if (!seen.count(&f))
+      continue;
+    const char *k = f.key.c_str();
+    if (f.required) {
+      printf("  if (!seen[%d])\n", seen[&f]);
+      printf("    return fail(errmsg, \"%s\", \"missing\");\n", k);
+    } else {
+      printf("  if (!seen[%d] && !load(0, ret.%s, errmsg))\n", seen[&f], k);
+      printf("    return nest(errmsg, \"%s.\");\n", k);
+    }
+  }
+  printf("  return true;\n");
+  printf("}\n\n");
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    cerr << "usage: " << argv[0] << " NAME [schema.toml]\n";
+    exit(1);
+  }
+  const char *name = argv[1];
+  const char *path = argc == 3 ? argv[2] : "<stdin>";
+  if (!is_identifier(name))
+    fatal(string("bad name ") + name);
+
+  string conf;
+  if (argc == 3) {
+    std::ifstream stream(path);
+    if (!stream)
+      fatal(string("cannot open ") + path + ":" + strerror(errno));
+    conf.assign(std::istreambuf_iterator<char>{stream}, {});
+  } else {
+    conf.assign(std::istreambuf_iterator<char>{std::cin}, {});
+  }
+
+  char errbuf[200];
+  toml_table_t *schema =
+      toml_parse_len(conf.data(), conf.size(), errbuf, sizeof(errbuf));
+  if (!schema)
+    fatal(string(path) + ": " + errbuf);
+  auto root = parse_struct(schema, name, "");
+  toml_free(schema);
+
+  printf("/* Generated by toml_codegen from %s. Do not edit. */\n", path);
+  printf("#pragma once\n");
+  printf("#include \"toml.h\"\n");
+  printf("#include \"tomlcpp.hpp\"\n");
+  printf("#include <cstdint>\n");
+  printf("#include <cstring>\n");
+  printf("#include <limits>\n");
+  printf("#include <string>\n");
+  printf("#include <vector>\n\n");
+  print_struct(*root, "");
+  printf("\nnamespace %s_loader {\n\n", name);
+  printf("inline bool fail(std::string &errmsg, const char *key,\n");
+  printf("                 const char *what) {\n");
+  printf("  errmsg = std::string(key) + \": \" + what;\n");
+  printf("  return false;\n");
+  printf("}\n\n");
+  printf("inline bool nest(std::string &errmsg, const std::string &prefix) "
+         "{\n");
+  printf("  errmsg = prefix + errmsg;\n");
+  printf("  return false;\n");
+  printf("}\n\n");
+  print_loader(*root);
+  printf("} // namespace %s_loader\n\n", name);
+  printf("// Load a document into ret. Fields that are not in the document "
+         "take\n");
+  printf("// their default, and keys that are not in the schema are "
+         "ignored.\n");
+  printf("// Return false and set errmsg if a field is missing or has the "
+         "wrong\n");
+  printf("// type.\n");
+  printf("inline bool load(const toml::Table &tab, %s &ret, std::string "
+         "&errmsg) {\n",
+         name);
+  printf("  ret = %s();\n", name);
+  printf("  return %s_loader::load(tab.ref().raw(), ret, errmsg);\n", name);
+  printf("}\n");
+  return 0;
+}
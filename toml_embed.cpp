@@ -0,0 +1,105 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/*
+ *  Usage: toml_embed NAME [file.toml]
+ *
+ *  Write to stdout a C/C++ source fragment that defines NAME as the binary
+ *  image of the document, for toml::loadImage() or toml_image_load().
+ *  The image is only valid on the platform it was generated on.
+ */
+
+#include "toml.h"
+#include "tomlcpp.hpp"
+#include <cctype>
+#include <errno.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::string;
+
+static void fatal(const string &msg) {
+  cerr << "ERROR: " << msg << "\n";
+  exit(1);
+}
+
+static bool is_identifier(const char *s) {
+  if (!(isalpha(*s) || *s == '_'))
+    return false;
+  for (s++; *s; s++) {
+    if (!(isalnum(*s) || *s == '_'))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    cerr << "usage: " << argv[0] << " NAME [file.toml]\n";
+    exit(1);
+  }
+  const char *name = argv[1];
+  const char *path = argc == 3 ? argv[2] : "<stdin>";
+  if (!is_identifier(name))
+    fatal(string("bad name ") + name);
+
+  string conf;
+  if (argc == 3) {
+    std::ifstream stream(path);
+    if (!stream)
+      fatal(string("cannot open ") + path + ":" + strerror(errno));
+    conf.assign(std::istreambuf_iterator<char>{stream}, {});
+  } else {
+    conf.assign(std::istreambuf_iterator<char>{std::cin}, {});
+  }
+
+  auto res = toml::parse(conf);
+  if (!res.table)
+    fatal(string(path) + ": " + res.errmsg);
+
+  toml_table_t *tab = res.table->ref().raw();
+  std::vector<unsigned char> image(toml_image_write(tab, 0, 0));
+  toml_image_write(tab, image.data(), image.size());
+
+  // The union keeps the image 8-byte aligned in both C and C++.
+  printf("/* Generated by toml_embed from %s. Do not edit. */\n", path);
+  printf("static const union {\n");
+  printf("  unsigned char image[%zu];\n", image.size());
+  printf("  long long align;\n");
+  printf("} %s = {{\n", name);
+  for (size_t i = 0; i < image.size(); i++) {
+    printf("%s0x%02x,", i % 12 ? " " : "    ", image[i]);
+    if (i % 12 == 11 || i + 1 == image.size())
+      printf("\n");
+  }
+  printf("}};\n");
+  return 0;
+}
@@ -26,15 +26,28 @@
 */
 #include "tomlcpp.hpp"
 #include "toml.h"
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
 
 using namespace toml;
 using std::pair;
 using std::string;
 using std::vector;
 
-static void *toml_mymalloc(size_t sz) { return new char[sz]; }
+// toml.c handles a failed allocation, but not an exception through it.
+static void *toml_mymalloc(size_t sz) { return new (std::nothrow) char[sz]; }
 
 static void toml_myfree(void *p) {
   if (p) {
@@ -43,28 +56,48 @@ static void toml_myfree(void *p) {
   }
 }
 
+// Make toml.c allocate with the functions above. It is done once, as the
+// allocator is a global that parses on other threads read.
+static void set_memutil() {
+  static std::once_flag once;
+  std::call_once(once, [] { toml_set_memutil(toml_mymalloc, toml_myfree); });
+}
+
 /**
  *  Keep track of memory to be freed when all references
  *  to the tree returned by toml::parse is no longer reachable.
  */
 struct toml::Backing {
-  char *ptr = 0;
+  std::shared_ptr<KeyPool> keys; // released after root is freed
   toml_table_t *root = 0;
-  Backing(const string &conf) {
-    ptr = new char[conf.length() + 1];
-    strcpy(ptr, conf.c_str());
-  }
+  void *map = 0; // image the tree was loaded from, if any
+  size_t maplen = 0;
   ~Backing() {
-    if (ptr)
-      delete[] ptr;
     if (root)
       toml_free(root);
+    if (map)
+      munmap(map, maplen);
   }
 };
 
-pair<bool, string> Table::getString(const string &key) const {
+static Timestamp make_timestamp(const toml_timestamp_t &ts) {
+  Timestamp ret;
+  ret.year = (ts.year ? *ts.year : -1);
+  ret.month = (ts.month ? *ts.month : -1);
+  ret.day = (ts.day ? *ts.day : -1);
+  ret.hour = (ts.hour ? *ts.hour : -1);
+  ret.minute = (ts.minute ? *ts.minute : -1);
+  ret.second = (ts.second ? *ts.second : -1);
+  ret.millisec = (ts.millisec ? *ts.millisec : -1);
+  ret.z = ts.z ? string(ts.z) : "";
+  return ret;
+}
+
+pair<bool, string> TableRef::getString(const char *key) const {
+  if (!m_table)
+    return {false, {}};
   string str;
-  toml_datum_t p = toml_string_in(m_table, key.c_str());
+  toml_datum_t p = toml_string_in(m_table, key);
   if (p.ok) {
     str = p.u.s;
     toml_myfree(p.u.s);
@@ -72,60 +105,131 @@ pair<bool, string> Table::getString(const string &key) const {
   return {p.ok, str};
 }
 
-pair<bool, bool> Table::getBool(const string &key) const {
-  toml_datum_t p = toml_bool_in(m_table, key.c_str());
+pair<bool, bool> TableRef::getBool(const char *key) const {
+  if (!m_table)
+    return {false, {}};
+  toml_datum_t p = toml_bool_in(m_table, key);
   return {p.ok, !!p.u.b};
 }
 
-pair<bool, int64_t> Table::getInt(const string &key) const {
-  toml_datum_t p = toml_int_in(m_table, key.c_str());
+pair<bool, int64_t> TableRef::getInt(const char *key) const {
+  if (!m_table)
+    return {false, {}};
+  toml_datum_t p = toml_int_in(m_table, key);
   return {p.ok, p.u.i};
 }
 
-pair<bool, double> Table::getDouble(const string &key) const {
-  toml_datum_t p = toml_double_in(m_table, key.c_str());
+pair<bool, double> TableRef::getDouble(const char *key) const {
+  if (!m_table)
+    return {false, {}};
+  toml_datum_t p = toml_double_in(m_table, key);
   return {p.ok, p.u.d};
 }
 
-pair<bool, Timestamp> Table::getTimestamp(const string &key) const {
+pair<bool, Timestamp> TableRef::getTimestamp(const char *key) const {
+  if (!m_table)
+    return {false, {}};
   Timestamp ret;
-  toml_datum_t p = toml_timestamp_in(m_table, key.c_str());
-  if (p.ok) {
-    toml_timestamp_t &ts = *p.u.ts;
-    ret.year = (ts.year ? *ts.year : -1);
-    ret.month = (ts.month ? *ts.month : -1);
-    ret.day = (ts.day ? *ts.day : -1);
-    ret.hour = (ts.hour ? *ts.hour : -1);
-    ret.minute = (ts.minute ? *ts.minute : -1);
-    ret.second = (ts.second ? *ts.second : -1);
-    ret.millisec = (ts.millisec ? *ts.millisec : -1);
-    ret.z = ts.z ? string(ts.z) : "";
-    toml_myfree(p.u.ts);
-  }
-  return {p.ok, ret};
+  bool ok = decode(toml_raw_in(m_table, key), ret);
+  return {ok, ret};
 }
 
-std::unique_ptr<Array> Table::getArray(const string &key) const {
-  toml_array_t *a = toml_array_in(m_table, key.c_str());
-  if (!a)
-    return 0;
+bool toml::decode(const char *raw, string &ret) {
+  char *s;
+  if (toml_rtos(raw, &s))
+    return false;
+  ret = s;
+  toml_myfree(s);
+  return true;
+}
 
-  auto ret = std::make_unique<Array>(a, m_backing);
-  return ret;
+bool toml::decode(const char *raw, bool &ret) {
+  int b;
+  if (toml_rtob(raw, &b))
+    return false;
+  ret = !!b;
+  return true;
 }
 
-std::unique_ptr<Table> Table::getTable(const string &key) const {
-  toml_table_t *t = toml_table_in(m_table, key.c_str());
-  if (!t)
-    return 0;
+bool toml::decode(const char *raw, int64_t &ret) {
+  return 0 == toml_rtoi(raw, &ret);
+}
 
-  auto ret = std::make_unique<Table>(t, m_backing);
-  return ret;
+bool toml::decode(const char *raw, double &ret) {
+  return 0 == toml_rtod(raw, &ret);
+}
+
+bool toml::decode(const char *raw, Timestamp &ret) {
+  toml_timestamp_t ts;
+  if (toml_rtots(raw, &ts))
+    return false;
+  ret = make_timestamp(ts);
+  return true;
+}
+
+int TableRef::lookup(vector<Lookup> &items) const {
+  const int n = items.size();
+  vector<const char *> keys(n);
+  vector<uint32_t> hashes(n);
+  vector<toml_raw_t> raw(n);
+  for (int k = 0; k < n; k++) {
+    Lookup &it = items[k];
+    if (!it.hash)
+      it.hash = toml_key_hash(it.key.c_str());
+    keys[k] = it.key.c_str();
+    hashes[k] = it.hash;
+  }
+  if (toml_table_lookup(m_table, keys.data(), hashes.data(), n, raw.data()) <
+      0)
+    return -1;
+
+  int found = 0;
+  for (int k = 0; k < n; k++) {
+    Lookup &it = items[k];
+    const char *v = raw[k];
+    switch (it.type) {
+    case 'i':
+      it.ok = v && decode(v, it.i);
+      break;
+    case 'd':
+      it.ok = v && decode(v, it.d);
+      break;
+    case 'b':
+      it.ok = v && decode(v, it.b);
+      break;
+    case 's':
+      it.ok = v && decode(v, it.s);
+      break;
+    case 't':
+      it.ok = v && decode(v, it.ts);
+      break;
+    default:
+      it.ok = false;
+    }
+    if (!it.ok) {
+      // do not leave the value of an earlier lookup behind
+      it.i = 0;
+      it.d = 0;
+      it.b = false;
+      it.s.clear();
+      it.ts = Timestamp();
+    }
+    found += it.ok;
+  }
+  return found;
+}
+
+ArrayRef TableRef::getArray(const char *key) const {
+  return m_table ? ArrayRef(toml_array_in(m_table, key)) : ArrayRef();
 }
 
-vector<string> Table::keys() const {
+TableRef TableRef::getTable(const char *key) const {
+  return m_table ? TableRef(toml_table_in(m_table, key)) : TableRef();
+}
+
+vector<string> TableRef::keys() const {
   vector<string> vec;
-  for (int i = 0;; i++) {
+  for (int i = 0; m_table; i++) {
     const char *k = toml_key_in(m_table, i);
     if (!k)
       break;
@@ -134,11 +238,13 @@ vector<string> Table::keys() const {
   return vec;
 }
 
-char Array::kind() const { return toml_array_kind(m_array); }
+char ArrayRef::kind() const { return m_array ? toml_array_kind(m_array) : 0; }
 
-char Array::type() const { return toml_array_type(m_array); }
+char ArrayRef::type() const { return m_array ? toml_array_type(m_array) : 0; }
 
-pair<bool, string> Array::getString(int idx) const {
+pair<bool, string> ArrayRef::getString(int idx) const {
+  if (!m_array)
+    return {false, {}};
   string str;
   toml_datum_t p = toml_string_at(m_array, idx);
   if (p.ok) {
@@ -148,40 +254,301 @@ pair<bool, string> Array::getString(int idx) const {
   return {p.ok, str};
 }
 
-pair<bool, bool> Array::getBool(int idx) const {
+pair<bool, bool> ArrayRef::getBool(int idx) const {
+  if (!m_array)
+    return {false, {}};
   toml_datum_t p = toml_bool_at(m_array, idx);
   return {p.ok, !!p.u.b};
 }
 
-pair<bool, int64_t> Array::getInt(int idx) const {
+pair<bool, int64_t> ArrayRef::getInt(int idx) const {
+  if (!m_array)
+    return {false, {}};
   toml_datum_t p = toml_int_at(m_array, idx);
   return {p.ok, p.u.i};
 }
 
-pair<bool, double> Array::getDouble(int idx) const {
+pair<bool, double> ArrayRef::getDouble(int idx) const {
+  if (!m_array)
+    return {false, {}};
   toml_datum_t p = toml_double_at(m_array, idx);
   return {p.ok, p.u.d};
 }
 
-pair<bool, Timestamp> Array::getTimestamp(int idx) const {
+pair<bool, Timestamp> ArrayRef::getTimestamp(int idx) const {
+  if (!m_array)
+    return {false, {}};
   Timestamp ret;
-  toml_datum_t p = toml_timestamp_at(m_array, idx);
-  if (p.ok) {
-    toml_timestamp_t &ts = *p.u.ts;
-    ret.year = (ts.year ? *ts.year : -1);
-    ret.month = (ts.month ? *ts.month : -1);
-    ret.day = (ts.day ? *ts.day : -1);
-    ret.hour = (ts.hour ? *ts.hour : -1);
-    ret.second = (ts.second ? *ts.second : -1);
-    ret.millisec = (ts.millisec ? *ts.millisec : -1);
-    ret.z = ts.z ? string(ts.z) : "";
-    toml_myfree(p.u.ts);
+  bool ok = decode(toml_raw_at(m_array, idx), ret);
+  return {ok, ret};
+}
+
+ArrayRef ArrayRef::getArray(int idx) const {
+  return m_array ? ArrayRef(toml_array_at(m_array, idx)) : ArrayRef();
+}
+
+TableRef ArrayRef::getTable(int idx) const {
+  return m_array ? TableRef(toml_table_at(m_array, idx)) : TableRef();
+}
+
+bool ArrayRef::getStringVector(vector<string> &ret) const {
+  ret.clear();
+  if (!m_array)
+    return false;
+  int top = toml_array_nelem(m_array);
+  ret.reserve(top);
+  for (int i = 0; i < top; i++) {
+    toml_datum_t p = toml_string_at(m_array, i);
+    if (!p.ok)
+      return false;
+    ret.push_back(p.u.s);
+    toml_myfree(p.u.s);
+  }
+  return true;
+}
+
+bool ArrayRef::getBoolVector(vector<bool> &ret) const {
+  ret.clear();
+  if (!m_array)
+    return false;
+  int top = toml_array_nelem(m_array);
+  for (int i = 0; i < top; i++) {
+    toml_datum_t p = toml_bool_at(m_array, i);
+    if (!p.ok)
+      return false;
+    ret.push_back(!!p.u.b);
+  }
+  return true;
+}
+
+bool ArrayRef::getIntVector(vector<int64_t> &ret) const {
+  ret.resize(size());
+  if (getInts(ret.data(), ret.size()) < 0) {
+    ret.clear();
+    return false;
+  }
+  return true;
+}
+
+bool ArrayRef::getDoubleVector(vector<double> &ret) const {
+  ret.resize(size());
+  if (getDoubles(ret.data(), ret.size()) < 0) {
+    ret.clear();
+    return false;
+  }
+  return true;
+}
+
+bool ArrayRef::getTimestampVector(vector<Timestamp> &ret) const {
+  ret.clear();
+  if (!m_array)
+    return false;
+  int top = toml_array_nelem(m_array);
+  ret.reserve(top);
+  for (int i = 0; i < top; i++) {
+    Timestamp ts;
+    if (!decode(toml_raw_at(m_array, i), ts))
+      return false;
+    ret.push_back(ts);
+  }
+  return true;
+}
+
+int ArrayRef::getInts(int64_t *buf, int n) const {
+  return m_array ? toml_int_array(m_array, buf, n) : -1;
+}
+
+int ArrayRef::getDoubles(double *buf, int n) const {
+  return m_array ? toml_double_array(m_array, buf, n) : -1;
+}
+
+pair<bool, Span<int64_t>> ArrayRef::getIntSpan() const {
+  if (!m_array)
+    return {false, {}};
+  int n = toml_array_nelem(m_array);
+  const int64_t *p = toml_int_data(m_array);
+  if (!p && n > 0)
+    return {false, {}};
+  return {true, Span<int64_t>(p, n)};
+}
+
+pair<bool, Span<double>> ArrayRef::getDoubleSpan() const {
+  if (!m_array)
+    return {false, {}};
+  int n = toml_array_nelem(m_array);
+  const double *p = toml_double_data(m_array);
+  if (!p && n > 0)
+    return {false, {}};
+  return {true, Span<double>(p, n)};
+}
+
+int ArrayRef::size() const { return m_array ? toml_array_nelem(m_array) : 0; }
+
+// Decode raw and append it to c. raw may be 0 for a missing value.
+static void append_to_column(Column &c, toml_raw_t raw) {
+  bool ok = false;
+  switch (c.type) {
+  case 'i': {
+    int64_t v = 0;
+    ok = (0 == toml_rtoi(raw, &v));
+    c.ints.push_back(ok ? v : 0);
+    break;
   }
-  return {p.ok, ret};
+  case 'd': {
+    double v = 0;
+    ok = (0 == toml_rtod(raw, &v));
+    c.doubles.push_back(ok ? v : 0);
+    break;
+  }
+  case 'b': {
+    int v = 0;
+    ok = (0 == toml_rtob(raw, &v));
+    c.bools.push_back(ok && v);
+    break;
+  }
+  case 's': {
+    size_t len = raw ? strlen(raw) : 0;
+    if (len >= 2 && (raw[0] == '\'' || raw[0] == '"') &&
+        raw[len - 1] == raw[0] && !(len >= 6 && raw[1] == raw[0]) &&
+        (raw[0] == '\'' || !memchr(raw, '\\', len))) {
+      // a one-line string with nothing to unescape; copy it as it is
+      c.text.append(raw + 1, len - 2);
+      ok = true;
+    } else {
+      char *s = 0;
+      if ((ok = (0 == toml_rtos(raw, &s))))
+        c.text.append(s);
+      toml_myfree(s);
+    }
+    c.offsets.push_back(c.text.size());
+    break;
+  }
+  case 't': {
+    toml_timestamp_t ts;
+    ok = (0 == toml_rtots(raw, &ts));
+    c.timestamps.push_back(ok ? make_timestamp(ts) : Timestamp());
+    break;
+  }
+  }
+  c.valid.push_back(ok);
+}
+
+bool ArrayRef::getColumns(const vector<pair<string, char>> &fields,
+                          vector<Column> &ret) const {
+  const int n = size();
+  ret.clear();
+  if (!m_array || (n > 0 && kind() != 't'))
+    return false;
+
+  vector<const char *> keys;
+  for (auto &f : fields) {
+    if (!f.second || !strchr("idbst", f.second))
+      return false;
+    Column c;
+    c.key = f.first;
+    c.type = f.second;
+    c.valid.reserve(n);
+    switch (c.type) {
+    case 'i':
+      c.ints.reserve(n);
+      break;
+    case 'd':
+      c.doubles.reserve(n);
+      break;
+    case 'b':
+      c.bools.reserve(n);
+      break;
+    case 's':
+      c.offsets.reserve(n + 1);
+      c.offsets.push_back(0);
+      break;
+    case 't':
+      c.timestamps.reserve(n);
+      break;
+    }
+    ret.push_back(std::move(c));
+    keys.push_back(f.first.c_str());
+  }
+
+  // Look up a block of rows at a time, then fill each column from it.
+  const int nkey = keys.size();
+  const int block = 256;
+  vector<toml_raw_t> raw((size_t)block * nkey);
+  for (int first = 0; first < n && nkey; first += block) {
+    int m = toml_array_columns(m_array, keys.data(), nkey, first, block,
+                               raw.data());
+    if (m < 0)
+      return false;
+    for (int k = 0; k < nkey; k++) {
+      for (int i = 0; i < m; i++)
+        append_to_column(ret[k], raw[(size_t)i * nkey + k]);
+    }
+  }
+  return true;
+}
+
+pair<bool, string> Table::getString(const string &key) const {
+  return ref().getString(key);
+}
+
+pair<bool, bool> Table::getBool(const string &key) const {
+  return ref().getBool(key);
+}
+
+pair<bool, int64_t> Table::getInt(const string &key) const {
+  return ref().getInt(key);
+}
+
+pair<bool, double> Table::getDouble(const string &key) const {
+  return ref().getDouble(key);
+}
+
+pair<bool, Timestamp> Table::getTimestamp(const string &key) const {
+  return ref().getTimestamp(key);
+}
+
+std::unique_ptr<Array> Table::getArray(const string &key) const {
+  toml_array_t *a = ref().getArray(key).raw();
+  if (!a)
+    return 0;
+
+  auto ret = std::make_unique<Array>(a, m_backing);
+  return ret;
+}
+
+std::unique_ptr<Table> Table::getTable(const string &key) const {
+  toml_table_t *t = ref().getTable(key).raw();
+  if (!t)
+    return 0;
+
+  auto ret = std::make_unique<Table>(t, m_backing);
+  return ret;
+}
+
+vector<string> Table::keys() const { return ref().keys(); }
+
+char Array::kind() const { return ref().kind(); }
+
+char Array::type() const { return ref().type(); }
+
+pair<bool, string> Array::getString(int idx) const {
+  return ref().getString(idx);
+}
+
+pair<bool, bool> Array::getBool(int idx) const { return ref().getBool(idx); }
+
+pair<bool, int64_t> Array::getInt(int idx) const { return ref().getInt(idx); }
+
+pair<bool, double> Array::getDouble(int idx) const {
+  return ref().getDouble(idx);
+}
+
+pair<bool, Timestamp> Array::getTimestamp(int idx) const {
+  return ref().getTimestamp(idx);
 }
 
 std::unique_ptr<Array> Array::getArray(int idx) const {
-  toml_array_t *a = toml_array_at(m_array, idx);
+  toml_array_t *a = ref().getArray(idx).raw();
   if (!a)
     return 0;
 
@@ -190,7 +557,7 @@ std::unique_ptr<Array> Array::getArray(int idx) const {
 }
 
 std::unique_ptr<Table> Array::getTable(int idx) const {
-  toml_table_t *t = toml_table_at(m_array, idx);
+  toml_table_t *t = ref().getTable(idx).raw();
   if (!t)
     return 0;
 
@@ -234,129 +601,949 @@ std::unique_ptr<vector<Table>> Array::getTableVector() const {
   return ret;
 }
 
+bool Array::getStringVector(vector<string> &ret) const {
+  return ref().getStringVector(ret);
+}
+
+bool Array::getBoolVector(vector<bool> &ret) const {
+  return ref().getBoolVector(ret);
+}
+
+bool Array::getIntVector(vector<int64_t> &ret) const {
+  return ref().getIntVector(ret);
+}
+
+bool Array::getDoubleVector(vector<double> &ret) const {
+  return ref().getDoubleVector(ret);
+}
+
+bool Array::getTimestampVector(vector<Timestamp> &ret) const {
+  return ref().getTimestampVector(ret);
+}
+
+int Array::getInts(int64_t *buf, int n) const { return ref().getInts(buf, n); }
+
+int Array::getDoubles(double *buf, int n) const {
+  return ref().getDoubles(buf, n);
+}
+
+pair<bool, Span<int64_t>> Array::getIntSpan() const {
+  return ref().getIntSpan();
+}
+
+pair<bool, Span<double>> Array::getDoubleSpan() const {
+  return ref().getDoubleSpan();
+}
+
 std::unique_ptr<vector<string>> Array::getStringVector() const {
-  int top = toml_array_nelem(m_array);
-  if (top < 0)
+  auto ret = std::make_unique<vector<string>>();
+  if (!getStringVector(*ret))
     return 0;
+  return ret;
+}
 
-  auto ret = std::make_unique<vector<string>>();
-  ret->reserve(top);
-  for (int i = 0; i < top; i++) {
-    toml_datum_t p = toml_string_at(m_array, i);
-    if (!p.ok)
-      return 0;
-    ret->push_back(p.u.s);
-    toml_myfree(p.u.s);
-  }
+std::unique_ptr<vector<bool>> Array::getBoolVector() const {
+  auto ret = std::make_unique<vector<bool>>();
+  if (!getBoolVector(*ret))
+    return 0;
+  return ret;
+}
 
+std::unique_ptr<vector<int64_t>> Array::getIntVector() const {
+  auto ret = std::make_unique<vector<int64_t>>();
+  if (!getIntVector(*ret))
+    return 0;
   return ret;
 }
 
-std::unique_ptr<vector<bool>> Array::getBoolVector() const {
-  int top = toml_array_nelem(m_array);
-  if (top < 0)
+std::unique_ptr<vector<Timestamp>> Array::getTimestampVector() const {
+  auto ret = std::make_unique<vector<Timestamp>>();
+  if (!getTimestampVector(*ret))
     return 0;
+  return ret;
+}
 
-  auto ret = std::make_unique<vector<bool>>();
-  ret->reserve(top);
-  for (int i = 0; i < top; i++) {
-    toml_datum_t p = toml_bool_at(m_array, i);
-    if (!p.ok)
-      return 0;
-    ret->push_back(!!p.u.b);
+std::unique_ptr<vector<double>> Array::getDoubleVector() const {
+  auto ret = std::make_unique<vector<double>>();
+  if (!getDoubleVector(*ret))
+    return 0;
+  return ret;
+}
+
+int Array::size() const { return ref().size(); }
+
+bool Array::getColumns(const vector<pair<string, char>> &fields,
+                       vector<Column> &ret) const {
+  return ref().getColumns(fields, ret);
+}
+
+toml::Result toml::parse(std::string_view conf) {
+  toml::Result ret;
+  char errbuf[200];
+  auto backing = std::make_shared<Backing>();
+
+  // The tree does not refer back to the text, so parse it in place.
+  set_memutil();
+  toml_table_t *t =
+      toml_parse_len(conf.data(), conf.size(), errbuf, sizeof(errbuf));
+  if (t) {
+    ret.table = std::make_shared<Table>(t, backing);
+    backing->root = t;
+  } else {
+    ret.errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+  }
+  return ret;
+}
+
+toml::Result toml::parseFile(const string &path) {
+  toml::Result ret;
+  std::ifstream stream(path);
+  if (!stream) {
+    ret.errmsg = strerror(errno);
+    return ret;
+  }
+  string conf(std::istreambuf_iterator<char>{stream}, {});
+  return toml::parse(conf);
+}
+
+/* The threads that run parseFileAsync(). They are started on first use,
+ * and stopped at exit; jobs still queued then are dropped.
+ */
+class AsyncPool {
+public:
+  static AsyncPool &get() {
+    static AsyncPool pool;
+    return pool;
   }
 
+  void post(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.push_back(std::move(job));
+    }
+    m_cond.notify_one();
+  }
+
+private:
+  AsyncPool() {
+    for (int i = 0; i < 2; i++)
+      m_threads.emplace_back([this] { run(); });
+  }
+
+  ~AsyncPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    for (auto &t : m_threads)
+      t.join();
+  }
+
+  void run() {
+    for (;;) {
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+        if (m_stop)
+          return;
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+      }
+      // A job that throws must not take the thread, and the process,
+      // down. The jobs of parseFileAsync() report their own errors; this
+      // only catches what done itself throws.
+      try {
+        job();
+      } catch (...) {
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<std::function<void()>> m_jobs;
+  vector<std::thread> m_threads;
+  bool m_stop = false;
+};
+
+void toml::parseFileAsync(const string &path,
+                          std::function<void(Result)> done) {
+  AsyncPool::get().post([path, done = std::move(done)] {
+    Result r;
+    try {
+      r = toml::parseFile(path);
+    } catch (const std::exception &e) {
+      r.errmsg = path + ": " + e.what();
+    } catch (...) {
+      r.errmsg = path + ": unknown error";
+    }
+    done(std::move(r));
+  });
+}
+
+std::future<toml::Result> toml::parseFileAsync(const string &path) {
+  auto promise = std::make_shared<std::promise<Result>>();
+  auto ret = promise->get_future();
+  AsyncPool::get().post([path, promise] {
+    try {
+      promise->set_value(toml::parseFile(path));
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+  });
   return ret;
 }
 
-std::unique_ptr<vector<int64_t>> Array::getIntVector() const {
-  int top = toml_array_nelem(m_array);
-  if (top < 0)
-    return 0;
+bool toml::validate(std::string_view conf, string &errmsg) {
+  char errbuf[200];
+  set_memutil();
+  if (toml_validate(conf.data(), conf.size(), errbuf, sizeof(errbuf))) {
+    errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+    return false;
+  }
+  return true;
+}
 
-  auto ret = std::make_unique<vector<int64_t>>();
-  ret->reserve(top);
-  for (int i = 0; i < top; i++) {
-    toml_datum_t p = toml_int_at(m_array, i);
-    if (!p.ok)
-      return 0;
-    ret->push_back(p.u.i);
+KeyPool::KeyPool() {
+  set_memutil();
+  m_pool = toml_keypool_new();
+}
+
+KeyPool::~KeyPool() { toml_keypool_free(m_pool); }
+
+toml::Result toml::parse(std::string_view conf,
+                         const std::shared_ptr<KeyPool> &keys) {
+  ParseOptions opts;
+  opts.keys = keys;
+  return toml::parse(conf, opts);
+}
+
+// Convert opts, except for the key pool. o.paths points into paths.
+static toml_options_t make_options(const ParseOptions &opts,
+                                   vector<const char *> &paths) {
+  toml_options_t o;
+  memset(&o, 0, sizeof(o));
+  if (!opts.paths.empty()) {
+    for (const auto &p : opts.paths)
+      paths.push_back(p.c_str());
+    paths.push_back(0);
+    o.paths = paths.data();
   }
+  o.max_bytes = opts.maxBytes;
+  o.max_nodes = opts.maxNodes;
+  o.max_memory = opts.maxMemory;
+  o.max_depth = opts.maxDepth;
+  o.max_strlen = opts.maxStringLength;
+  if (opts.timeout.count() > 0)
+    o.timeout_ms = (int)std::min<int64_t>(opts.timeout.count(), INT32_MAX);
+  if (opts.cancel) {
+    o.cancel = [](void *arg) -> int {
+      return static_cast<const std::atomic<bool> *>(arg)->load(
+          std::memory_order_relaxed);
+    };
+    o.cancel_arg = const_cast<std::atomic<bool> *>(opts.cancel);
+  }
+  return o;
+}
+
+toml::Result toml::parse(std::string_view conf, const ParseOptions &opts) {
+  toml::Result ret;
+  char errbuf[200];
+  auto backing = std::make_shared<Backing>();
+  backing->keys = opts.keys;
+
+  vector<const char *> paths;
+  toml_options_t o = make_options(opts, paths);
+  o.errcode = &ret.errcode;
 
+  std::unique_lock<std::mutex> lock;
+  if (opts.keys) {
+    lock = std::unique_lock<std::mutex>(opts.keys->m_mutex);
+    o.keys = opts.keys->m_pool;
+  }
+  set_memutil();
+  toml_table_t *t =
+      toml_parse_opts(conf.data(), conf.size(), &o, errbuf, sizeof(errbuf));
+  if (t) {
+    ret.table = std::make_shared<Table>(t, backing);
+    backing->root = t;
+  } else {
+    ret.errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+  }
   return ret;
 }
 
-std::unique_ptr<vector<Timestamp>> Array::getTimestampVector() const {
-  int top = toml_array_nelem(m_array);
-  if (top < 0)
-    return 0;
+StreamParser::StreamParser(const ParseOptions &opts)
+    : m_backing(std::make_shared<Backing>()) {
+  m_backing->keys = opts.keys;
 
-  auto ret = std::make_unique<vector<Timestamp>>();
-  ret->reserve(top);
-  for (int i = 0; i < top; i++) {
-    toml_datum_t p = toml_timestamp_at(m_array, i);
-    if (!p.ok)
-      return 0;
+  vector<const char *> paths;
+  toml_options_t o = make_options(opts, paths);
+  o.errcode = &m_errcode;
+  std::unique_lock<std::mutex> lock;
+  if (opts.keys) {
+    lock = std::unique_lock<std::mutex>(opts.keys->m_mutex);
+    o.keys = opts.keys->m_pool;
+  }
+  set_memutil();
+  if (!(m_stream = toml_stream_open(&o))) {
+    m_errmsg = "out of memory";
+    m_errcode = TOML_ERR_NOMEM;
+  }
+}
+
+StreamParser::~StreamParser() { toml_stream_close(m_stream); }
 
-    toml_timestamp_t &ts = *p.u.ts;
-    Timestamp v;
-    v.year = (ts.year ? *ts.year : -1);
-    v.month = (ts.month ? *ts.month : -1);
-    v.day = (ts.day ? *ts.day : -1);
-    v.hour = (ts.hour ? *ts.hour : -1);
-    v.second = (ts.second ? *ts.second : -1);
-    v.millisec = (ts.millisec ? *ts.millisec : -1);
-    v.z = ts.z ? string(ts.z) : "";
-    toml_myfree(p.u.ts);
+bool StreamParser::feed(const char *data, size_t n) {
+  if (!m_stream)
+    return false;
+  char errbuf[200];
+  std::unique_lock<std::mutex> lock;
+  if (m_backing->keys)
+    lock = std::unique_lock<std::mutex>(m_backing->keys->m_mutex);
+  if (toml_stream_feed(m_stream, data, n, errbuf, sizeof(errbuf))) {
+    m_errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+    // the document is lost; let go of it now
+    toml_stream_close(m_stream);
+    m_stream = 0;
+    return false;
+  }
+  return true;
+}
 
-    ret->push_back(v);
+toml::Result StreamParser::finish() {
+  toml::Result ret;
+  if (!m_stream) {
+    ret.errmsg = m_errmsg.empty() ? "stream already finished" : m_errmsg;
+    ret.errcode = m_errcode;
+    return ret;
   }
 
+  char errbuf[200];
+  std::unique_lock<std::mutex> lock;
+  if (m_backing->keys)
+    lock = std::unique_lock<std::mutex>(m_backing->keys->m_mutex);
+  toml_table_t *t = toml_stream_finish(m_stream, errbuf, sizeof(errbuf));
+  m_stream = 0;
+  if (lock)
+    lock.unlock();
+  if (t) {
+    ret.table = std::make_shared<Table>(t, m_backing);
+    m_backing->root = t;
+  } else {
+    ret.errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+  }
+  ret.errcode = m_errcode;
   return ret;
 }
 
-std::unique_ptr<vector<double>> Array::getDoubleVector() const {
-  int top = toml_array_nelem(m_array);
-  if (top < 0)
-    return 0;
+RecordReader::RecordReader(std::istream &in, string key,
+                           const ParseOptions &opts)
+    : m_in(in), m_key(std::move(key)),
+      m_keys(opts.keys ? opts.keys : std::make_shared<KeyPool>()) {
+  // the tables outlive the stream, so their keys need a pool of their own
+  vector<const char *> paths;
+  toml_options_t o = make_options(opts, paths);
+  std::lock_guard<std::mutex> lock(m_keys->m_mutex);
+  o.keys = m_keys->m_pool;
+  set_memutil();
+  if (!(m_stream = toml_stream_open(&o)))
+    m_errmsg = "out of memory";
+}
 
-  auto ret = std::make_unique<vector<double>>();
-  ret->reserve(top);
-  for (int i = 0; i < top; i++) {
-    toml_datum_t p = toml_double_at(m_array, i);
-    if (!p.ok)
+RecordReader::~RecordReader() { toml_stream_close(m_stream); }
+
+std::shared_ptr<Table> RecordReader::next() {
+  while (m_pos == m_ready.size()) {
+    m_ready.clear();
+    m_pos = 0;
+    if (!fill())
       return 0;
-    ret->push_back(p.u.d);
   }
+  return std::move(m_ready[m_pos++]);
+}
+
+// Read and parse the next part of the input, and queue the tables that
+// are complete. Return false once there is nothing more to read.
+bool RecordReader::fill() {
+  if (!m_stream)
+    return false;
+
+  char errbuf[200];
+  char buf[65536];
+  m_in.read(buf, sizeof(buf));
+  const size_t n = m_in.gcount();
+  std::lock_guard<std::mutex> lock(m_keys->m_mutex);
+  if (n > 0 && toml_stream_feed(m_stream, buf, n, errbuf, sizeof(errbuf))) {
+    m_errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+    toml_stream_close(m_stream);
+    m_stream = 0;
+    return false;
+  }
+
+  toml_table_t *tabs[256];
+  int k;
+  while ((k = toml_stream_take(m_stream, m_key.c_str(), tabs, 256)) > 0) {
+    for (int i = 0; i < k; i++) {
+      auto backing = std::make_shared<Backing>();
+      backing->keys = m_keys;
+      backing->root = tabs[i];
+      m_ready.push_back(std::make_shared<Table>(tabs[i], backing));
+    }
+  }
+  if (m_in.bad()) {
+    // a truncated input must not pass for a complete one; the tables
+    // queued so far are still handed out
+    m_errmsg = "error reading the input";
+    toml_stream_close(m_stream);
+    m_stream = 0;
+    return !m_ready.empty();
+  }
+  if (n > 0)
+    return true;
+
+  // end of input: the last table is in what remains of the document
+  toml_table_t *t = toml_stream_finish(m_stream, errbuf, sizeof(errbuf));
+  m_stream = 0;
+  if (!t) {
+    m_errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+    return false;
+  }
+  auto backing = std::make_shared<Backing>();
+  backing->keys = m_keys;
+  backing->root = t;
+  toml_array_t *arr = toml_array_in(t, m_key.c_str());
+  for (int i = 0; arr && i < toml_array_nelem(arr); i++) {
+    toml_table_t *tab = toml_table_at(arr, i);
+    if (tab)
+      m_ready.push_back(std::make_shared<Table>(tab, backing));
+  }
+  return true;
+}
+
+static void stat_mtime(const struct stat &st, int64_t &sec, int64_t &nsec) {
+#ifdef __APPLE__
+  sec = st.st_mtimespec.tv_sec;
+  nsec = st.st_mtimespec.tv_nsec;
+#else
+  sec = st.st_mtim.tv_sec;
+  nsec = st.st_mtim.tv_nsec;
+#endif
+}
+
+// FNV-1a, 64-bit
+static uint64_t content_hash(const string &s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char ch : s) {
+    h ^= ch;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+ParseCache &ParseCache::global() {
+  static ParseCache cache;
+  return cache;
+}
+
+ParseCache::Stats ParseCache::stats() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_stats;
+}
+
+void ParseCache::clear() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_lru.clear();
+  m_index.clear();
+  m_stats.files = m_stats.bytes = 0;
+}
+
+toml::Result ParseCache::parseFile(const string &path) {
+  toml::Result ret;
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    ret.errmsg = strerror(errno);
+    return ret;
+  }
+
+  Entry ent;
+  ent.path = path;
+  ent.dev = st.st_dev;
+  ent.ino = st.st_ino;
+  ent.size = st.st_size;
+  stat_mtime(st, ent.mtime_sec, ent.mtime_nsec);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  auto it = m_index.find(path);
+  if (it != m_index.end()) {
+    Entry &e = *it->second;
+    if (e.dev == ent.dev && e.ino == ent.ino && e.size == ent.size &&
+        e.mtime_sec == ent.mtime_sec && e.mtime_nsec == ent.mtime_nsec) {
+      m_lru.splice(m_lru.begin(), m_lru, it->second);
+      m_stats.hits++;
+      ret.table = e.table;
+      return ret;
+    }
+  }
+  lock.unlock();
+
+  // Read and parse without holding the lock.
+  std::ifstream stream(path);
+  if (!stream) {
+    ret.errmsg = strerror(errno);
+    return ret;
+  }
+  string conf(std::istreambuf_iterator<char>{stream}, {});
+  ent.hash = content_hash(conf);
+
+  lock.lock();
+  it = m_index.find(path);
+  if (it != m_index.end() && it->second->hash == ent.hash &&
+      it->second->size == conf.size()) {
+    // Touched or replaced, but the content is the same.
+    ent.table = it->second->table;
+    m_stats.hits++;
+  } else {
+    lock.unlock();
+    ret = toml::parse(conf);
+    if (!ret.table)
+      return ret;
+    ent.table = ret.table;
+    lock.lock();
+    m_stats.misses++;
+    it = m_index.find(path);
+  }
+  ent.size = conf.size();
+  ret.table = ent.table;
 
+  if (it != m_index.end()) {
+    m_stats.bytes -= it->second->size;
+    m_lru.erase(it->second);
+    m_index.erase(it);
+    m_stats.files = m_lru.size();
+  }
+  if (ent.size > m_budget)
+    return ret;
+
+  m_stats.bytes += ent.size;
+  m_lru.push_front(std::move(ent));
+  m_index[path] = m_lru.begin();
+  while (m_stats.bytes > m_budget) {
+    m_stats.bytes -= m_lru.back().size;
+    m_index.erase(m_lru.back().path);
+    m_lru.pop_back();
+    m_stats.evictions++;
+  }
+  m_stats.files = m_lru.size();
   return ret;
 }
 
-int toml::Array::size() const { return toml_array_nelem(m_array); }
+/**
+ *  A file in the image cache directory: this header, followed by the
+ *  image at an 8-byte aligned offset.
+ */
+struct ImageHeader {
+  char magic[8];
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t hash; // of the source file
+  uint64_t pad;
+};
+static const char IMAGE_CACHE_MAGIC[] = "TOMLCAC1";
 
-toml::Result toml::parse(const string &conf) {
+static string image_path(const string &path, const string &cachedir) {
+  char *abspath = realpath(path.c_str(), 0);
+  char name[40];
+  snprintf(name, sizeof(name), "/%016llx.img",
+           (unsigned long long)content_hash(abspath ? abspath : path));
+  ::free(abspath);
+  return cachedir + name;
+}
+
+// Write the image of t to imgpath, through a temp file so that readers
+// never see a partial file. Failures are ignored.
+static void save_image(const string &imgpath, const ImageHeader &hdr,
+                       toml_table_t *t) {
+  size_t len = toml_image_write(t, 0, 0);
+  string buf(sizeof(hdr) + len, 0);
+  memcpy(&buf[0], &hdr, sizeof(hdr));
+  toml_image_write(t, &buf[sizeof(hdr)], len);
+
+  string tmp = imgpath + ".XXXXXX";
+  int fd = mkstemp(&tmp[0]);
+  if (fd < 0)
+    return;
+  size_t off = 0;
+  while (off < buf.size()) {
+    ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  if (close(fd) == 0 && off == buf.size() &&
+      rename(tmp.c_str(), imgpath.c_str()) == 0)
+    return;
+  unlink(tmp.c_str());
+}
+
+// Map imgpath, check it against the source file, and load the tree. The
+// source is matched by its stat() if match_stat, or else by its hash.
+static toml::Result load_image(const string &imgpath, const ImageHeader &src,
+                               bool match_stat) {
   toml::Result ret;
-  char errbuf[200];
-  auto backing = std::make_shared<Backing>(conf);
+  int fd = open(imgpath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return ret;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(ImageHeader))
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return ret;
 
-  toml_set_memutil(toml_mymalloc, toml_myfree);
-  toml_table_t *t = toml_parse(backing->ptr, errbuf, sizeof(errbuf));
+  auto backing = std::make_shared<Backing>();
+  backing->map = map;
+  backing->maplen = st.st_size;
+
+  const ImageHeader *hdr = (const ImageHeader *)map;
+  bool ok = !memcmp(hdr->magic, IMAGE_CACHE_MAGIC, 8) && hdr->size == src.size;
+  if (match_stat)
+    ok = ok && hdr->dev == src.dev && hdr->ino == src.ino &&
+         hdr->mtime_sec == src.mtime_sec && hdr->mtime_nsec == src.mtime_nsec;
+  else
+    ok = ok && hdr->hash == src.hash;
+  if (!ok)
+    return ret;
+
+  char errbuf[200];
+  set_memutil();
+  toml_table_t *t = toml_image_load(hdr + 1, st.st_size - sizeof(*hdr),
+                                    errbuf, sizeof(errbuf));
   if (t) {
-    ret.table = std::make_shared<Table>(t, backing);
     backing->root = t;
-  } else {
-    ret.errmsg = (*errbuf) ? string(errbuf) : "unknown error";
+    ret.table = std::make_shared<Table>(t, backing);
   }
   return ret;
 }
 
-toml::Result toml::parseFile(const string &path) {
+toml::Result toml::parseFileCached(const string &path, const string &cachedir) {
   toml::Result ret;
+  struct stat st;
+  if (stat(path.c_str(), &st)) {
+    ret.errmsg = strerror(errno);
+    return ret;
+  }
+
+  ImageHeader hdr = {};
+  memcpy(hdr.magic, IMAGE_CACHE_MAGIC, 8);
+  hdr.dev = st.st_dev;
+  hdr.ino = st.st_ino;
+  hdr.size = st.st_size;
+  stat_mtime(st, hdr.mtime_sec, hdr.mtime_nsec);
+
+  string imgpath = image_path(path, cachedir);
+  ret = load_image(imgpath, hdr, true);
+  if (ret.table)
+    return ret;
+
   std::ifstream stream(path);
   if (!stream) {
     ret.errmsg = strerror(errno);
     return ret;
   }
   string conf(std::istreambuf_iterator<char>{stream}, {});
-  return toml::parse(conf);
+  hdr.size = conf.size();
+  hdr.hash = content_hash(conf);
+
+  // The file was touched or replaced, but may still have the same content.
+  ret = load_image(imgpath, hdr, false);
+  if (!ret.table) {
+    ret = toml::parse(conf);
+    if (!ret.table)
+      return ret;
+  }
+  save_image(imgpath, hdr, ret.table->ref().raw());
+  return ret;
+}
+
+toml::Result toml::loadImage(const void *image, size_t len) {
+  toml::Result ret;
+  char errbuf[200];
+  set_memutil();
+  toml_table_t *t = toml_image_load(image, len, errbuf, sizeof(errbuf));
+  if (!t) {
+    ret.errmsg = errbuf;
+    return ret;
+  }
+  auto backing = std::make_shared<Backing>();
+  backing->root = t;
+  ret.table = std::make_shared<Table>(t, backing);
+  return ret;
+}
+
+// Run write, one of toml_msgpack_write() and toml_cbor_write(), into a
+// string that is grown once if the first guess is too small.
+static string encode(size_t (*write)(const toml_table_t *, void *, size_t),
+                     const Table &tab) {
+  toml_table_t *t = tab.ref().raw();
+  string ret(4096, '\0');
+  set_memutil();
+  size_t n = write(t, &ret[0], ret.size());
+  if (n > ret.size()) {
+    ret.resize(n);
+    n = write(t, &ret[0], ret.size());
+  }
+  ret.resize(n);
+  return ret;
+}
+
+string toml::toMsgPack(const Table &tab) {
+  return encode(toml_msgpack_write, tab);
+}
+
+string toml::toCBOR(const Table &tab) { return encode(toml_cbor_write, tab); }
+
+const Table *Overlay::find(const string &key) const {
+  for (auto it = m_layers.rbegin(); it != m_layers.rend(); ++it) {
+    if (toml_key_exists((*it)->ref().raw(), key.c_str()))
+      return it->get();
+  }
+  return 0;
+}
+
+vector<string> Overlay::keys() const {
+  vector<string> vec;
+  std::unordered_set<string> seen;
+  for (auto &layer : m_layers) {
+    for (auto &key : layer->keys()) {
+      if (seen.insert(key).second)
+        vec.push_back(key);
+    }
+  }
+  return vec;
+}
+
+pair<bool, string> Overlay::getString(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getString(key) : pair<bool, string>(false, "");
+}
+
+pair<bool, bool> Overlay::getBool(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getBool(key) : pair<bool, bool>(false, false);
+}
+
+pair<bool, int64_t> Overlay::getInt(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getInt(key) : pair<bool, int64_t>(false, 0);
+}
+
+pair<bool, double> Overlay::getDouble(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getDouble(key) : pair<bool, double>(false, 0);
+}
+
+pair<bool, Timestamp> Overlay::getTimestamp(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getTimestamp(key) : pair<bool, Timestamp>(false, Timestamp());
+}
+
+std::unique_ptr<Array> Overlay::getArray(const string &key) const {
+  const Table *t = find(key);
+  return t ? t->getArray(key) : 0;
+}
+
+std::shared_ptr<Overlay> Overlay::getTable(const string &key) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_subtables.find(key);
+  if (it != m_subtables.end())
+    return it->second;
+
+  // Collect from the top down; a layer that sets key to a value or an
+  // array hides the layers below it.
+  vector<std::shared_ptr<Table>> sub;
+  for (auto it = m_layers.rbegin(); it != m_layers.rend(); ++it) {
+    if (!toml_key_exists((*it)->ref().raw(), key.c_str()))
+      continue;
+    auto t = (*it)->getTable(key);
+    if (!t)
+      break;
+    sub.push_back(std::move(t));
+  }
+  if (sub.empty())
+    return 0;
+
+  std::reverse(sub.begin(), sub.end());
+  auto ret = std::make_shared<Overlay>(std::move(sub));
+  m_subtables[key] = ret;
+  return ret;
+}
+
+// Append key to a path, quoting it unless it is a bare key.
+static string join_key(const string &path, const char *key) {
+  string ret = path.empty() ? path : path + ".";
+  bool bare = *key != 0;
+  for (const char *p = key; *p; p++) {
+    char ch = *p;
+    if (!(isalnum((unsigned char)ch) || ch == '_' || ch == '-'))
+      bare = false;
+  }
+  if (bare)
+    return ret + key;
+
+  ret += '"';
+  for (const char *p = key; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      ret += '\\';
+    ret += *p;
+  }
+  return ret + '"';
+}
+
+static string join_index(const string &path, int idx) {
+  return path + "[" + std::to_string(idx) + "]";
+}
+
+static Value decode(toml_raw_t raw) {
+  Value v;
+  v.kind = 'v';
+  if (*raw == '"' || *raw == '\'') {
+    char *s = 0;
+    if (0 == toml_rtos(raw, &s)) {
+      v.type = 's';
+      v.s = s;
+      toml_myfree(s);
+    }
+    return v;
+  }
+
+  int b;
+  toml_timestamp_t ts;
+  if (0 == toml_rtob(raw, &b)) {
+    v.type = 'b';
+    v.b = b;
+  } else if (0 == toml_rtoi(raw, &v.i)) {
+    v.type = 'i';
+  } else if (0 == toml_rtod(raw, &v.d)) {
+    v.type = 'd';
+  } else if (0 == toml_rtots(raw, &ts)) {
+    v.type = 't';
+    v.ts = make_timestamp(ts);
+  }
+  return v;
+}
+
+static Value value_in(toml_table_t *tab, const char *key) {
+  toml_raw_t raw = toml_raw_in(tab, key);
+  if (raw)
+    return decode(raw);
+  Value v;
+  if ((v.array = ArrayRef(toml_array_in(tab, key))))
+    v.kind = 'a';
+  else if ((v.table = TableRef(toml_table_in(tab, key))))
+    v.kind = 't';
+  return v;
+}
+
+static Value value_at(toml_array_t *arr, int idx) {
+  toml_raw_t raw = toml_raw_at(arr, idx);
+  if (raw)
+    return decode(raw);
+  Value v;
+  if ((v.array = ArrayRef(toml_array_at(arr, idx))))
+    v.kind = 'a';
+  else if ((v.table = TableRef(toml_table_at(arr, idx))))
+    v.kind = 't';
+  return v;
+}
+
+static bool same_timestamp(const Timestamp &a, const Timestamp &b) {
+  return a.year == b.year && a.month == b.month && a.day == b.day &&
+         a.hour == b.hour && a.minute == b.minute && a.second == b.second &&
+         a.millisec == b.millisec && a.z == b.z;
+}
+
+static bool same_value(const Value &a, const Value &b) {
+  if (a.type != b.type)
+    return false;
+  switch (a.type) {
+  case 's':
+    return a.s == b.s;
+  case 'b':
+    return a.b == b.b;
+  case 'i':
+    return a.i == b.i;
+  case 'd':
+    return a.d == b.d || (a.d != a.d && b.d != b.d); // nan == nan
+  case 't':
+    return same_timestamp(a.ts, b.ts);
+  }
+  return true;
+}
+
+static void diff_table(const string &path, toml_table_t *a, toml_table_t *b,
+                       vector<Change> &out);
+
+static void diff_array(const string &path, toml_array_t *a, toml_array_t *b,
+                       vector<Change> &out);
+
+static void diff_value(const string &path, Value &&a, Value &&b,
+                       vector<Change> &out) {
+  if (a.kind == b.kind) {
+    switch (a.kind) {
+    case 't':
+      diff_table(path, a.table.raw(), b.table.raw(), out);
+      return;
+    case 'a':
+      diff_array(path, a.array.raw(), b.array.raw(), out);
+      return;
+    case 'v':
+      if (same_value(a, b))
+        return;
+    }
+  }
+  out.push_back({'~', path, std::move(a), std::move(b)});
+}
+
+static void diff_array(const string &path, toml_array_t *a, toml_array_t *b,
+                       vector<Change> &out) {
+  int na = toml_array_nelem(a);
+  int nb = toml_array_nelem(b);
+  int i = 0;
+  for (; i < na && i < nb; i++)
+    diff_value(join_index(path, i), value_at(a, i), value_at(b, i), out);
+  for (; i < na; i++)
+    out.push_back({'-', join_index(path, i), value_at(a, i), Value()});
+  for (; i < nb; i++)
+    out.push_back({'+', join_index(path, i), Value(), value_at(b, i)});
+}
+
+static void diff_table(const string &path, toml_table_t *a, toml_table_t *b,
+                       vector<Change> &out) {
+  // Keys of a, in order: removed or possibly changed.
+  const char *key;
+  for (int i = 0; 0 != (key = toml_key_in(a, i)); i++) {
+    string kpath = join_key(path, key);
+    if (!toml_key_exists(b, key))
+      out.push_back({'-', kpath, value_in(a, key), Value()});
+    else
+      diff_value(kpath, value_in(a, key), value_in(b, key), out);
+  }
+
+  // Keys only in b: added.
+  for (int i = 0; 0 != (key = toml_key_in(b, i)); i++) {
+    if (!toml_key_exists(a, key))
+      out.push_back({'+', join_key(path, key), Value(), value_in(b, key)});
+  }
+}
+
+vector<Change> toml::diff(TableRef before, TableRef after) {
+  vector<Change> out;
+  diff_table("", before.raw(), after.raw(), out);
+  return out;
 }
@@ -25,19 +25,33 @@
 #ifndef TOML_HPP
 #define TOML_HPP
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <iterator>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 struct toml_table_t;
 struct toml_array_t;
+struct toml_keypool_t;
+struct toml_stream_t;
 
 namespace toml {
 
 struct Backing;
 class Array;
 class Table;
+class ArrayRef;
+class TableRef;
 using std::pair;
 using std::string;
 using std::vector;
@@ -55,6 +69,177 @@ struct Timestamp {
   string z; // "" if no timezone
 };
 
+/* A read-only view of contiguous values inside a parsed document. It is
+ * valid for as long as the Table or Array it was obtained from. */
+template <typename T> class Span {
+public:
+  Span() = default;
+  Span(const T *ptr, size_t len) : m_ptr(ptr), m_len(len) {}
+
+  const T *data() const { return m_ptr; }
+  size_t size() const { return m_len; }
+  bool empty() const { return m_len == 0; }
+  const T &operator[](size_t i) const { return m_ptr[i]; }
+  const T *begin() const { return m_ptr; }
+  const T *end() const { return m_ptr + m_len; }
+
+private:
+  const T *m_ptr = 0;
+  size_t m_len = 0;
+};
+
+/* A key to look up with Table::lookup(), and its value. type is as in
+ * Column; only the member of that type is set. ok is false if the table
+ * has no value for the key, or a value of another type; the members are
+ * then reset.
+ */
+struct Lookup {
+  string key;
+  char type = 0; // i:int, d:double, b:bool, s:string, t:timestamp
+
+  // toml_key_hash() of key, set by the first lookup() so that a list
+  // kept for many lookups is hashed once. Reset it to 0 to change key.
+  uint32_t hash = 0;
+
+  bool ok = false;
+  int64_t i = 0;
+  double d = 0;
+  bool b = false;
+  string s;
+  Timestamp ts;
+};
+
+/* One key of every table in an array of tables, as typed values. See
+ * Array::getColumns(). Only the values of the requested type are filled.
+ */
+struct Column {
+  string key;
+  char type = 0; // i:int, d:double, b:bool, s:string, t:timestamp
+
+  // valid[i] is false if row i has no such key, or a value of another
+  // type. The value of the row is then 0, false, "" or -1s.
+  vector<bool> valid;
+
+  vector<int64_t> ints;
+  vector<double> doubles;
+  vector<bool> bools;
+  vector<Timestamp> timestamps;
+
+  // The text of all strings, one after another: string i is at
+  // offsets[i] .. offsets[i+1].
+  string text;
+  vector<size_t> offsets;
+  std::string_view getString(size_t i) const {
+    return std::string_view(text).substr(offsets[i],
+                                         offsets[i + 1] - offsets[i]);
+  }
+
+  size_t size() const { return valid.size(); }
+};
+
+/* A non-owning view of a table. It is trivially copyable and holds no
+ * reference count, so it must not outlive the Table or Result it was
+ * obtained from. Reading values through it does not allocate, except
+ * for strings. An empty view converts to false; its getters fail and
+ * return empty views, as for a missing key.
+ */
+class TableRef {
+public:
+  TableRef() = default;
+  explicit TableRef(toml_table_t *t) : m_table(t) {}
+  explicit operator bool() const { return m_table != 0; }
+
+  vector<string> keys() const;
+
+  // get content
+  pair<bool, string> getString(const char *key) const;
+  pair<bool, bool> getBool(const char *key) const;
+  pair<bool, int64_t> getInt(const char *key) const;
+  pair<bool, double> getDouble(const char *key) const;
+  pair<bool, Timestamp> getTimestamp(const char *key) const;
+  TableRef getTable(const char *key) const;
+  ArrayRef getArray(const char *key) const;
+
+  pair<bool, string> getString(const string &key) const {
+    return getString(key.c_str());
+  }
+  pair<bool, bool> getBool(const string &key) const {
+    return getBool(key.c_str());
+  }
+  pair<bool, int64_t> getInt(const string &key) const {
+    return getInt(key.c_str());
+  }
+  pair<bool, double> getDouble(const string &key) const {
+    return getDouble(key.c_str());
+  }
+  pair<bool, Timestamp> getTimestamp(const string &key) const {
+    return getTimestamp(key.c_str());
+  }
+  TableRef getTable(const string &key) const;
+  ArrayRef getArray(const string &key) const;
+
+  // Look up all the items at once, see Table::lookup().
+  int lookup(vector<Lookup> &items) const;
+
+  toml_table_t *raw() const { return m_table; }
+
+private:
+  toml_table_t *m_table = 0;
+};
+
+/* A non-owning view of an array. See TableRef. */
+class ArrayRef {
+public:
+  ArrayRef() = default;
+  explicit ArrayRef(toml_array_t *a) : m_array(a) {}
+  explicit operator bool() const { return m_array != 0; }
+
+  char kind() const;
+  char type() const;
+  int size() const;
+
+  pair<bool, string> getString(int idx) const;
+  pair<bool, bool> getBool(int idx) const;
+  pair<bool, int64_t> getInt(int idx) const;
+  pair<bool, double> getDouble(int idx) const;
+  pair<bool, Timestamp> getTimestamp(int idx) const;
+  TableRef getTable(int idx) const;
+  ArrayRef getArray(int idx) const;
+
+  bool getStringVector(vector<string> &ret) const;
+  bool getBoolVector(vector<bool> &ret) const;
+  bool getIntVector(vector<int64_t> &ret) const;
+  bool getDoubleVector(vector<double> &ret) const;
+  bool getTimestampVector(vector<Timestamp> &ret) const;
+  int getInts(int64_t *buf, int n) const;
+  int getDoubles(double *buf, int n) const;
+  pair<bool, Span<int64_t>> getIntSpan() const;
+  pair<bool, Span<double>> getDoubleSpan() const;
+  bool getColumns(const vector<pair<string, char>> &fields,
+                  vector<Column> &ret) const;
+
+  toml_array_t *raw() const { return m_array; }
+
+private:
+  toml_array_t *m_array = 0;
+};
+
+// Decode a raw value, as returned by toml_entry_in(). These are for code
+// that walks tables itself, such as the loaders made by toml_codegen.
+bool decode(const char *raw, string &ret);
+bool decode(const char *raw, bool &ret);
+bool decode(const char *raw, int64_t &ret);
+bool decode(const char *raw, double &ret);
+bool decode(const char *raw, Timestamp &ret);
+
+inline TableRef TableRef::getTable(const string &key) const {
+  return getTable(key.c_str());
+}
+
+inline ArrayRef TableRef::getArray(const string &key) const {
+  return getArray(key.c_str());
+}
+
 /* A table in toml. You can extract value/table/array using a key. */
 class Table {
 public:
@@ -69,6 +254,13 @@ public:
   std::unique_ptr<Table> getTable(const string &key) const;
   std::unique_ptr<Array> getArray(const string &key) const;
 
+  // Look up the values of many keys in one pass over the table, and set
+  // each item. Return the #items set ok, or -1 if out of memory.
+  int lookup(vector<Lookup> &items) const { return ref().lookup(items); }
+
+  // Obtain a non-owning view; valid while this Table is alive.
+  TableRef ref() const { return TableRef(m_table); }
+
   // internal
   Table(toml_table_t *t, std::shared_ptr<Backing> backing)
       : m_table(t), m_backing(backing) {}
@@ -113,10 +305,40 @@ public:
   std::unique_ptr<vector<double>> getDoubleVector() const;
   std::unique_ptr<vector<Timestamp>> getTimestampVector() const;
 
+  // Same as above, but fill a caller-owned vector. The vector is cleared
+  // and refilled, so it may be reused across calls to avoid reallocation.
+  // Return false if any element has a different type.
+  bool getStringVector(vector<string> &ret) const;
+  bool getBoolVector(vector<bool> &ret) const;
+  bool getIntVector(vector<int64_t> &ret) const;
+  bool getDoubleVector(vector<double> &ret) const;
+  bool getTimestampVector(vector<Timestamp> &ret) const;
+
+  // Copy the values into a caller-owned buffer of n elements.
+  // Return #elements copied, or -1 on type mismatch or if n is too small.
+  int getInts(int64_t *buf, int n) const;
+  int getDoubles(double *buf, int n) const;
+
+  // Obtain the values of an int (or double) array without copying. This
+  // fails for an array too large to be packed (over 2GB of text); use
+  // getIntVector() or getDoubleVector() for those.
+  pair<bool, Span<int64_t>> getIntSpan() const;
+  pair<bool, Span<double>> getDoubleSpan() const;
+
   // Obtain vectors of table or array
   std::unique_ptr<vector<Table>> getTableVector() const;
   std::unique_ptr<vector<Array>> getArrayVector() const;
 
+  // For an array of tables, extract some keys of every table into one
+  // column per key, in a single pass. Each field is a key and the type
+  // of its column, e.g. {{"id", 'i'}, {"name", 's'}}.
+  // Return false if this is not an array of tables, or a type is unknown.
+  bool getColumns(const vector<pair<string, char>> &fields,
+                  vector<Column> &ret) const;
+
+  // Obtain a non-owning view; valid while this Array is alive.
+  ArrayRef ref() const { return ArrayRef(m_array); }
+
   // internal
   Array(toml_array_t *a, std::shared_ptr<Backing> backing)
       : m_array(a), m_backing(backing) {}
@@ -132,10 +354,313 @@ private:
 struct Result {
   std::shared_ptr<Table> table;
   string errmsg;
+  int errcode = 0; // TOML_ERR_* on failure of parse() with ParseOptions
 };
 
-Result parse(const string &conf);
+// Parse a document. The text is parsed in place and is not copied, and
+// the result does not refer to it afterwards.
+Result parse(std::string_view conf);
 Result parseFile(const string &path);
+
+// Read and parse a file on a background thread, so that the caller does
+// not block on the disk. A small pool of threads is shared by all calls.
+std::future<Result> parseFileAsync(const string &path);
+// Same, but call done with the result on the background thread. If the
+// parse throws, e.g. std::bad_alloc, done gets a Result with errmsg set;
+// an exception thrown by done itself is dropped.
+void parseFileAsync(const string &path, std::function<void(Result)> done);
+
+// Check that conf is a valid document, without building a tree. Return
+// false with errmsg set to the first error if it is not.
+bool validate(std::string_view conf, string &errmsg);
+
+struct ParseOptions;
+
+/* A pool of keys shared by several documents, so that the keys they have
+ * in common are stored once. Parses that share a pool run one at a time.
+ */
+class KeyPool {
+public:
+  KeyPool();
+  ~KeyPool();
+
+private:
+  friend Result parse(std::string_view, const ParseOptions &);
+  friend class StreamParser;
+  friend class RecordReader;
+  toml_keypool_t *m_pool;
+  std::mutex m_mutex;
+
+  KeyPool(const KeyPool &) = delete;
+  KeyPool &operator=(const KeyPool &) = delete;
+};
+
+// Parse a document, interning its keys into a shared pool.
+Result parse(std::string_view conf, const std::shared_ptr<KeyPool> &keys);
+
+struct ParseOptions {
+  // If set, intern keys into this pool.
+  std::shared_ptr<KeyPool> keys;
+
+  // If not empty, only keep the entries under these dotted key paths,
+  // e.g. {"server", "database.pool"}. See toml_options_t in toml.h.
+  vector<string> paths;
+
+  // Limits for untrusted input, 0 for none. See toml_options_t.
+  size_t maxBytes = 0;
+  int maxNodes = 0;
+  size_t maxMemory = 0;
+  int maxDepth = 0;
+  int maxStringLength = 0;
+
+  // Give up with TOML_ERR_TIMEOUT after this long, 0 for never.
+  std::chrono::milliseconds timeout{0};
+
+  // If set, give up with TOML_ERR_CANCELLED once *cancel becomes true.
+  const std::atomic<bool> *cancel = 0;
+};
+
+// Parse a document with options.
+Result parse(std::string_view conf, const ParseOptions &opts);
+
+/* Parse a document as it arrives in pieces, e.g. from a socket or a
+ * decompressor. Each piece is parsed as soon as it completes a statement,
+ * so only the statement being received is buffered, even across multi-line
+ * strings and arrays. opts.keys is only held while a call runs, so other
+ * parses that share it can run between calls. If opts.cancel is set, the
+ * flag must outlive the parser.
+ */
+class StreamParser {
+public:
+  explicit StreamParser(const ParseOptions &opts = ParseOptions());
+  ~StreamParser();
+
+  // Add the next n bytes of the document. Return false with errmsg() set
+  // once the document is known to be invalid.
+  bool feed(const char *data, size_t n);
+  bool feed(std::string_view data) { return feed(data.data(), data.size()); }
+
+  // Parse the rest of the document and return it. Call it once.
+  Result finish();
+
+  const string &errmsg() const { return m_errmsg; }
+
+private:
+  toml_stream_t *m_stream = 0;
+  std::shared_ptr<Backing> m_backing;
+  int m_errcode = 0;
+  string m_errmsg;
+
+  StreamParser(const StreamParser &) = delete;
+  StreamParser &operator=(const StreamParser &) = delete;
+};
+
+/* Read a document made of [[key]] tables, such as a large data export,
+ * one table at a time:
+ *
+ *   std::ifstream in(path);
+ *   toml::RecordReader reader(in, "records");
+ *   for (auto rec : reader) { ... }
+ *
+ * The input is parsed as it is read, and each table is handed out as
+ * soon as it is complete, so memory is bounded by the tables in one
+ * read of the input rather than by the document. The rest of the
+ * document is parsed too, and freed along with the last table.
+ *
+ * Keys are kept in one pool, opts.keys or the reader's own, until the
+ * reader and all its tables are gone. Records whose key names depend on
+ * the data, e.g. ids used as keys, make it grow with the input.
+ */
+class RecordReader {
+public:
+  RecordReader(std::istream &in, string key,
+               const ParseOptions &opts = ParseOptions());
+  ~RecordReader();
+
+  // Return the next table, or 0 at the end of the input or on error.
+  std::shared_ptr<Table> next();
+
+  // Empty unless the input turned out to be invalid, or failed to read.
+  const string &errmsg() const { return m_errmsg; }
+
+  class iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::shared_ptr<Table>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = const value_type &;
+
+    iterator() = default;
+    explicit iterator(RecordReader *r) : m_reader(r) { ++*this; }
+    reference operator*() const { return m_cur; }
+    iterator &operator++() {
+      if (!(m_cur = m_reader->next()))
+        m_reader = 0;
+      return *this;
+    }
+    bool operator==(const iterator &x) const { return m_reader == x.m_reader; }
+    bool operator!=(const iterator &x) const { return m_reader != x.m_reader; }
+
+  private:
+    RecordReader *m_reader = 0;
+    std::shared_ptr<Table> m_cur;
+  };
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(); }
+
+private:
+  bool fill();
+
+  std::istream &m_in;
+  const string m_key;
+  std::shared_ptr<KeyPool> m_keys;
+  toml_stream_t *m_stream = 0;
+  vector<std::shared_ptr<Table>> m_ready;
+  size_t m_pos = 0;
+  string m_errmsg;
+
+  RecordReader(const RecordReader &) = delete;
+  RecordReader &operator=(const RecordReader &) = delete;
+};
+
+// Same as parseFile(), but keep a binary image of the tree in cachedir,
+// and map it instead of parsing the next time the file is unchanged.
+// The cache is best effort: errors writing to cachedir are ignored.
+Result parseFileCached(const string &path, const string &cachedir);
+
+// Rebuild a tree from an image made by toml_image_write() or by the
+// toml_embed tool, without parsing. Strings and arrays are used in place,
+// so the image must outlive the tree; it is never modified or freed.
+Result loadImage(const void *image, size_t len);
+
+// Encode a table as MessagePack or CBOR, straight from the tree. See
+// toml_msgpack_write() for how values are mapped.
+string toMsgPack(const Table &tab);
+string toCBOR(const Table &tab);
+
+/* A cache of parsed files. A cached file is only parsed again if it has
+ * changed: the cache first compares the device, inode, mtime and size of
+ * the file, and if any of them differ, a hash of its content. When the
+ * cached files add up to more than the budget in bytes (of file size),
+ * the least recently used ones are dropped. Thread-safe.
+ */
+class ParseCache {
+public:
+  explicit ParseCache(size_t budget = 64 * 1024 * 1024) : m_budget(budget) {}
+
+  // The process-wide cache
+  static ParseCache &global();
+
+  // Same as toml::parseFile(), but the table may be shared with earlier
+  // callers. Files are identified by path as given. Errors are not cached.
+  Result parseFile(const string &path);
+
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t files = 0;
+    size_t bytes = 0;
+  };
+  Stats stats() const;
+
+  // Drop all cached files. Tables already returned remain valid.
+  void clear();
+
+private:
+  struct Entry {
+    string path;
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t hash;
+    std::shared_ptr<Table> table;
+  };
+
+  const size_t m_budget;
+  mutable std::mutex m_mutex;
+  std::list<Entry> m_lru; // most recently used first
+  std::unordered_map<string, std::list<Entry>::iterator> m_index;
+  Stats m_stats;
+
+  ParseCache(const ParseCache &) = delete;
+  ParseCache &operator=(const ParseCache &) = delete;
+};
+
+/* A stack of documents, e.g. defaults, then site, then host settings.
+ * A key is looked up from the top layer down, and the first layer that
+ * defines it wins. Subtables defined in several layers are merged into a
+ * new Overlay when first asked for, and remembered; nothing is copied.
+ */
+class Overlay {
+public:
+  // layers[0] is the bottom layer.
+  explicit Overlay(vector<std::shared_ptr<Table>> layers)
+      : m_layers(std::move(layers)) {}
+
+  // All keys defined in any layer
+  vector<string> keys() const;
+
+  // get content from the top-most layer that defines key
+  pair<bool, string> getString(const string &key) const;
+  pair<bool, bool> getBool(const string &key) const;
+  pair<bool, int64_t> getInt(const string &key) const;
+  pair<bool, double> getDouble(const string &key) const;
+  pair<bool, Timestamp> getTimestamp(const string &key) const;
+  std::unique_ptr<Array> getArray(const string &key) const;
+
+  // Merge the subtables from the top layer down to the first layer that
+  // defines key as something other than a table. Thread-safe.
+  std::shared_ptr<Overlay> getTable(const string &key) const;
+
+  const vector<std::shared_ptr<Table>> &layers() const { return m_layers; }
+
+private:
+  const Table *find(const string &key) const;
+
+  const vector<std::shared_ptr<Table>> m_layers;
+  mutable std::mutex m_mutex;
+  mutable std::unordered_map<string, std::shared_ptr<Overlay>> m_subtables;
+
+  Overlay(const Overlay &) = delete;
+  Overlay &operator=(const Overlay &) = delete;
+};
+
+/* A decoded value, as reported by diff(). */
+struct Value {
+  // v:value, t:table, a:array, 0:none
+  char kind = 0;
+
+  // For values only: s:string, b:bool, i:int, d:double, t:timestamp
+  char type = 0;
+  string s;
+  bool b = false;
+  int64_t i = 0;
+  double d = 0;
+  Timestamp ts;
+
+  // For tables and arrays only
+  TableRef table;
+  ArrayRef array;
+};
+
+/* A difference between two documents. */
+struct Change {
+  char op;      // '+':added, '-':removed, '~':changed
+  string path;  // e.g. server.ports[1], or "a.b".c for keys needing quotes
+  Value oldval; // kind 0 if added
+  Value newval; // kind 0 if removed
+};
+
+// Compare two documents in a single pass. Keys are matched by name and
+// values are compared after decoding, so 0x10 equals 16. Array elements
+// are matched by position. A table or array that was added or removed is
+// reported once, as a whole. The views in the result are only valid while
+// both documents are.
+vector<Change> diff(TableRef before, TableRef after);
+inline vector<Change> diff(const Table &before, const Table &after) {
+  return diff(before.ref(), after.ref());
+}
 }; // namespace toml
 
 #endif /* TOML_HPP */
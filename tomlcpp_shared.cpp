@@ -0,0 +1,252 @@
+/*
+
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include "tomlcpp_shared.hpp"
+#include "toml.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace toml;
+
+/*
+ *  The object named by the user: it only holds the generation of the
+ *  current version, which is in the object NAME.<generation>. Once the
+ *  name is unpublished, the generation is RETIRED, so that readers still
+ *  mapping the header know to look the name up again.
+ */
+struct toml::SharedHeader {
+  char magic[8];
+  std::atomic<uint64_t> generation;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the generation must be lock-free to be shared");
+
+static const char SHARED_MAGIC[] = "TOMLSHM1";
+static const uint64_t RETIRED = UINT64_MAX;
+
+static string version_name(const string &name, uint64_t generation) {
+  return name + "." + std::to_string(generation);
+}
+
+// Map the header of name, opened with oflag: O_RDONLY, O_RDWR, or
+// O_RDWR | O_CREAT to create it with mode if needed. Return 0 on failure.
+static SharedHeader *map_header(const string &name, int oflag,
+                                mode_t mode = 0) {
+  const bool writable = (oflag & O_ACCMODE) != O_RDONLY;
+  int fd = shm_open(name.c_str(), oflag, mode);
+  if (fd < 0)
+    return 0;
+  void *map = MAP_FAILED;
+  struct stat st;
+  if (fstat(fd, &st) == 0 &&
+      (st.st_size >= (off_t)sizeof(SharedHeader) ||
+       ((oflag & O_CREAT) && ftruncate(fd, sizeof(SharedHeader)) == 0)))
+    map = mmap(0, sizeof(SharedHeader),
+               writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd,
+               0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  SharedHeader *hdr = (SharedHeader *)map;
+  if ((oflag & O_CREAT) && memcmp(hdr->magic, SHARED_MAGIC, 8)) {
+    // a new object is zero-filled, so its generation is already 0
+    memcpy(hdr->magic, SHARED_MAGIC, 8);
+  }
+  if (memcmp(hdr->magic, SHARED_MAGIC, 8)) {
+    munmap(map, sizeof(SharedHeader));
+    return 0;
+  }
+  return hdr;
+}
+
+bool toml::publishShared(const string &name, const Table &tab,
+                         string &errmsg, mode_t mode) {
+  SharedHeader *hdr = map_header(name, O_RDWR | O_CREAT, mode);
+  if (!hdr) {
+    errmsg = name + ": " + strerror(errno);
+    return false;
+  }
+  if (hdr->generation.load() == RETIRED) {
+    // unpublishShared() is removing the name
+    errmsg = name + ": being unpublished";
+    munmap(hdr, sizeof(*hdr));
+    return false;
+  }
+  const uint64_t generation = hdr->generation.load() + 1;
+  const string vname = version_name(name, generation);
+
+  // Write the new version in full before it is made current.
+  toml_table_t *t = tab.ref().raw();
+  const size_t len = toml_image_write(t, 0, 0);
+  bool ok = false;
+  // a publisher that crashed may have left this version half written
+  shm_unlink(vname.c_str());
+  int fd = shm_open(vname.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+  if (fd >= 0) {
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, len) == 0)
+      map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      toml_image_write(t, map, len);
+      munmap(map, len);
+      ok = true;
+    }
+    close(fd);
+  }
+  if (!ok) {
+    errmsg = vname + ": " + strerror(errno);
+    if (fd >= 0)
+      shm_unlink(vname.c_str());
+    munmap(hdr, sizeof(*hdr));
+    return false;
+  }
+
+  hdr->generation.store(generation, std::memory_order_release);
+  if (generation > 1)
+    shm_unlink(version_name(name, generation - 1).c_str());
+  munmap(hdr, sizeof(*hdr));
+  return true;
+}
+
+void toml::unpublishShared(const string &name) {
+  SharedHeader *hdr = map_header(name, O_RDWR);
+  if (hdr) {
+    const uint64_t generation = hdr->generation.exchange(RETIRED);
+    if (generation != RETIRED)
+      shm_unlink(version_name(name, generation).c_str());
+    munmap(hdr, sizeof(*hdr));
+  }
+  shm_unlink(name.c_str());
+}
+
+SharedReader::~SharedReader() {
+  if (m_header)
+    munmap((void *)m_header, sizeof(*m_header));
+}
+
+bool SharedReader::attach() {
+  if (!m_header)
+    m_header = map_header(m_name, O_RDONLY);
+  return m_header != 0;
+}
+
+// Return the current generation, or 0 if the name is not published.
+uint64_t SharedReader::current() {
+  for (int i = 0; i < 2 && attach(); i++) {
+    uint64_t generation = m_header->generation.load(std::memory_order_acquire);
+    if (generation != RETIRED)
+      return generation;
+
+    // The name was unpublished, and may have been published again under
+    // a new header whose generations start over: drop what we have.
+    munmap((void *)m_header, sizeof(*m_header));
+    m_header = 0;
+    m_generation = 0;
+    m_table.reset();
+  }
+  return 0;
+}
+
+uint64_t SharedReader::generation() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return current();
+}
+
+/*
+ *  Keep a version mapped for as long as a table of it is in use. The
+ *  table is released first, as it points into the mapping.
+ */
+struct SharedVersion {
+  void *map = 0;
+  size_t len = 0;
+  std::shared_ptr<Table> table;
+  ~SharedVersion() {
+    table.reset();
+    if (map)
+      munmap(map, len);
+  }
+};
+
+Result SharedReader::table() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Result ret;
+  uint64_t generation = current();
+  if (generation == 0) {
+    ret.errmsg = m_name + ": not published";
+    return ret;
+  }
+  if (generation == m_generation) {
+    ret.table = m_table;
+    return ret;
+  }
+
+  // A version is unlinked once the next is published, so if it is gone,
+  // look for the newer one.
+  int fd;
+  string vname;
+  for (;;) {
+    vname = version_name(m_name, generation);
+    fd = shm_open(vname.c_str(), O_RDONLY, 0);
+    uint64_t latest = m_header->generation.load(std::memory_order_acquire);
+    if (fd >= 0 || errno != ENOENT || latest == generation)
+      break;
+    generation = latest;
+  }
+  if (fd < 0) {
+    ret.errmsg = vname + ": " + strerror(errno);
+    return ret;
+  }
+
+  auto version = std::make_shared<SharedVersion>();
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ret.errmsg = vname + ": " + strerror(errno);
+    return ret;
+  }
+  version->map = map;
+  version->len = st.st_size;
+
+  ret = loadImage(map, st.st_size);
+  if (!ret.table) {
+    ret.errmsg = vname + ": " + ret.errmsg;
+    return ret;
+  }
+  version->table = ret.table;
+  ret.table = std::shared_ptr<Table>(version, version->table.get());
+  m_table = ret.table;
+  m_generation = generation;
+  return ret;
+}
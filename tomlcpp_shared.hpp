@@ -0,0 +1,88 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef TOML_SHARED_HPP
+#define TOML_SHARED_HPP
+
+#include "tomlcpp.hpp"
+#include <mutex>
+#include <sys/types.h>
+
+namespace toml {
+
+/*
+ * Share a parsed document between the processes of a host through POSIX
+ * shared memory. The publisher writes the binary image of the tree (see
+ * toml_image_write()) into a shared memory object, and readers map it
+ * read-only and use its strings and arrays in place, so they exist once
+ * per host however many processes read them. Only the nodes of the tree
+ * are rebuilt in each reader.
+ *
+ * Each publish creates a new version named NAME.<generation>, and then
+ * bumps the generation kept in NAME. A version is never modified once
+ * published; a reader that holds tables of an older one keeps it mapped
+ * until it lets go of them. There should be one publisher per name.
+ */
+
+// Publish tab under name, e.g. "/myapp.conf", replacing the version
+// published before. Return false with errmsg set on failure. By default
+// only the user of the publisher can read it; pass a mode such as 0644
+// to share it with other users of the host.
+bool publishShared(const string &name, const Table &tab, string &errmsg,
+                   mode_t mode = 0600);
+
+// Remove name and its current version. Readers keep the tables they
+// have, but no longer return them, even if name is published again.
+void unpublishShared(const string &name);
+
+/* A reader of a document published with publishShared(). Thread-safe. */
+class SharedReader {
+public:
+  explicit SharedReader(string name) : m_name(std::move(name)) {}
+  ~SharedReader();
+
+  // The generation last published under the name, or 0 if there is none.
+  uint64_t generation();
+
+  // Return the latest version of the document. It is mapped on the first
+  // call and after each publish; other calls return the same table.
+  Result table();
+
+private:
+  bool attach();
+  uint64_t current();
+
+  const string m_name;
+  std::mutex m_mutex;
+  const struct SharedHeader *m_header = 0; // mapping of the name
+  uint64_t m_generation = 0;               // of m_table
+  std::shared_ptr<Table> m_table;
+
+  SharedReader(const SharedReader &) = delete;
+  SharedReader &operator=(const SharedReader &) = delete;
+};
+
+}; // namespace toml
+
+#endif /* TOML_SHARED_HPP */
@@ -0,0 +1,199 @@
+/*
+
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#include "tomlcpp_watch.hpp"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+using namespace toml;
+
+/* Events that mean a file in a watched directory may have new content.
+ * Editors that save by writing a temp file and renaming it over the
+ * original show up as IN_MOVED_TO, so the directory is watched rather than
+ * the file itself. */
+static const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+static string dir_of(const string &path) {
+  size_t pos = path.rfind('/');
+  if (pos == string::npos)
+    return ".";
+  return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+static string base_of(const string &path) {
+  size_t pos = path.rfind('/');
+  return pos == string::npos ? path : path.substr(pos + 1);
+}
+
+ConfigWatcher::ConfigWatcher(vector<string> paths, int debounceMs)
+    : m_paths(std::move(paths)), m_debounceMs(debounceMs) {}
+
+ConfigWatcher::~ConfigWatcher() { stop(); }
+
+bool ConfigWatcher::start(string &errmsg) {
+  if (m_thread.joinable()) {
+    errmsg = "already started";
+    return false;
+  }
+
+  auto snap = std::make_shared<Snapshot>();
+  for (const auto &path : m_paths) {
+    auto res = parseFile(path);
+    if (!res.table) {
+      errmsg = path + ": " + res.errmsg;
+      return false;
+    }
+    snap->tables.push_back(res.table);
+  }
+
+  m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (m_inotify < 0 || pipe2(m_wakeup, O_NONBLOCK | O_CLOEXEC) < 0) {
+    errmsg = string("inotify: ") + strerror(errno);
+    stop();
+    return false;
+  }
+
+  // One watch per directory; inotify returns the same wd for duplicates.
+  m_wds.clear();
+  for (const auto &path : m_paths) {
+    int wd = inotify_add_watch(m_inotify, dir_of(path).c_str(), WATCH_MASK);
+    if (wd < 0) {
+      errmsg = dir_of(path) + ": " + strerror(errno);
+      stop();
+      return false;
+    }
+    m_wds.push_back(wd);
+  }
+
+  std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(snap));
+  m_thread = std::thread(&ConfigWatcher::run, this);
+  return true;
+}
+
+void ConfigWatcher::stop() {
+  if (m_thread.joinable()) {
+    char c = 0;
+    while (write(m_wakeup[1], &c, 1) < 0 && errno == EINTR)
+      ;
+    m_thread.join();
+  }
+  for (int *fd : {&m_inotify, &m_wakeup[0], &m_wakeup[1]}) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+  }
+}
+
+void ConfigWatcher::run() {
+  using clock = std::chrono::steady_clock;
+
+  vector<string> bases;
+  for (const auto &path : m_paths)
+    bases.push_back(base_of(path));
+
+  vector<bool> dirty(m_paths.size());
+  bool pending = false;
+  clock::time_point deadline;
+  alignas(struct inotify_event) char buf[sizeof(struct inotify_event) +
+                                         NAME_MAX + 1];
+
+  for (;;) {
+    int timeout = -1;
+    if (pending) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - clock::now());
+      timeout = left.count() > 0 ? (int)left.count() : 0;
+    }
+
+    struct pollfd fds[2] = {{m_wakeup[0], POLLIN, 0}, {m_inotify, POLLIN, 0}};
+    int rc = poll(fds, 2, timeout);
+    if (rc < 0 && errno != EINTR)
+      return;
+    if (fds[0].revents)
+      return;
+
+    if (fds[1].revents & POLLIN) {
+      ssize_t len;
+      while ((len = read(m_inotify, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+          auto ev = (struct inotify_event *)p;
+          p += sizeof(*ev) + ev->len;
+          if (ev->mask & IN_Q_OVERFLOW) {
+            // Events were dropped, so any file may have changed.
+            dirty.assign(dirty.size(), true);
+            pending = true;
+            continue;
+          }
+          if (!ev->len)
+            continue;
+          for (size_t i = 0; i < m_paths.size(); i++) {
+            if (ev->wd == m_wds[i] && bases[i] == ev->name) {
+              dirty[i] = true;
+              pending = true;
+            }
+          }
+        }
+      }
+      // Restart the quiet period on every burst of events.
+      if (pending)
+        deadline = clock::now() + std::chrono::milliseconds(m_debounceMs);
+      continue;
+    }
+
+    if (pending && clock::now() >= deadline) {
+      reload(dirty);
+      dirty.assign(dirty.size(), false);
+      pending = false;
+    }
+  }
+}
+
+void ConfigWatcher::reload(const vector<bool> &dirty) {
+  auto old = snapshot();
+  auto snap = std::make_shared<Snapshot>(*old);
+  snap->generation = old->generation + 1;
+
+  bool changed = false;
+  for (size_t i = 0; i < m_paths.size(); i++) {
+    if (!dirty[i])
+      continue;
+    auto res = parseFile(m_paths[i]);
+    if (res.table) {
+      snap->tables[i] = res.table;
+      changed = true;
+    }
+    if (m_callback)
+      m_callback(i, res.table ? string() : res.errmsg);
+  }
+
+  if (changed)
+    std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(snap));
+}
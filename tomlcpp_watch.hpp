@@ -0,0 +1,100 @@
+/*
+  MIT License
+
+  Copyright (c) 2020 CK Tan
+  https://github.com/cktan/tomlcpp
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+#ifndef TOML_WATCH_HPP
+#define TOML_WATCH_HPP
+
+#include "tomlcpp.hpp"
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace toml {
+
+/* The parsed content of all watched files at one point in time. */
+struct Snapshot {
+  uint64_t generation = 0;
+  vector<std::shared_ptr<Table>> tables; // one per path, in order
+};
+
+/*
+ * Watch one or more toml files with inotify, and re-parse them on a
+ * background thread when they change. Bursts of changes are coalesced
+ * and only handled once the files have been quiet for debounceMs.
+ *
+ * Each reload publishes a new Snapshot. Readers call snapshot() and keep
+ * the returned pointer for as long as they need a consistent view; the
+ * old trees are freed when the last reader drops them. If a file fails
+ * to parse, the previous table for it is kept.
+ */
+class ConfigWatcher {
+public:
+  explicit ConfigWatcher(vector<string> paths, int debounceMs = 100);
+  ~ConfigWatcher();
+
+  // Parse all files and start watching. Return false with errmsg set if
+  // any file fails to parse or inotify cannot be set up.
+  bool start(string &errmsg);
+
+  // Stop the background thread. Snapshots remain valid.
+  void stop();
+
+  // Return the current snapshot.
+  std::shared_ptr<const Snapshot> snapshot() const {
+    return std::atomic_load(&m_snapshot);
+  }
+
+  // Return the current table of the idx-th path.
+  std::shared_ptr<Table> table(size_t idx = 0) const {
+    auto snap = snapshot();
+    return (snap && idx < snap->tables.size()) ? snap->tables[idx] : 0;
+  }
+
+  // Called on the watcher thread after each reload attempt of a file.
+  // errmsg is empty if the file was parsed successfully. Set it before
+  // start().
+  using Callback = std::function<void(size_t idx, const string &errmsg)>;
+  void onReload(Callback cb) { m_callback = std::move(cb); }
+
+private:
+  void run();
+  void reload(const vector<bool> &dirty);
+
+  const vector<string> m_paths;
+  const int m_debounceMs;
+  Callback m_callback;
+
+  std::shared_ptr<const Snapshot> m_snapshot;
+  std::thread m_thread;
+  int m_inotify = -1;
+  vector<int> m_wds; // inotify watch of the directory of each path
+  int m_wakeup[2] = {-1, -1};
+
+  ConfigWatcher(const ConfigWatcher &) = delete;
+  ConfigWatcher &operator=(const ConfigWatcher &) = delete;
+};
+
+}; // namespace toml
+
+#endif /* TOML_WATCH_HPP */